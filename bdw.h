@@ -99,6 +99,17 @@ static inline void* allocate_pointerless(struct mutator *mut,
   return GC_malloc_atomic(size);
 }
 
+// Allocate up to N objects of the same KIND and SIZE, storing them in
+// OBJS, and return how many were allocated.  There's no bulk path in
+// the inline allocator, so just allocate them one by one; as BDW-GC
+// finds roots conservatively, all N can be allocated at once.
+static inline size_t allocate_many(struct mutator *mut, enum alloc_kind kind,
+                                   size_t size, size_t n, void **objs) {
+  for (size_t i = 0; i < n; i++)
+    objs[i] = allocate(mut, kind, size);
+  return n;
+}
+
 static inline void collect(struct mutator *mut) {
   GC_gcollect();
 }
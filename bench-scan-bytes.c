@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "scan-bytes.h"
+
+// Microbenchmark for the metadata byte scanners in scan-bytes.h.  We
+// fill a number of block-sized metadata tables with objects of varying
+// sizes, some live and some dead, then time finding all holes in all
+// blocks, as the whippet sweeper does in next_hole_in_block.  We also
+// time finding the extent of live objects of various sizes.
+
+#define BLOCK_GRANULES 4096
+#define BLOCK_COUNT 256
+#define ITERATIONS 100
+
+#define LIVE_BIT 0x02
+#define DEAD_BIT 0x08
+#define END_BIT 0x10
+
+static unsigned long current_time(void) {
+  struct timeval t = { 0 };
+  gettimeofday(&t, NULL);
+  return t.tv_sec * 1000 * 1000 + t.tv_usec;
+}
+
+static uint32_t random_state = 42;
+static uint32_t next_random(void) {
+  random_state = random_state * 1103515245 + 12345;
+  return random_state >> 8;
+}
+
+// Fill METADATA with objects of between 1 and MAX_GRANULES granules,
+// each live with probability LIVE_PERCENT.
+static void fill_blocks(uint8_t *metadata, size_t max_granules,
+                        unsigned live_percent) {
+  random_state = 42;
+  for (size_t block = 0; block < BLOCK_COUNT; block++) {
+    uint8_t *bytes = metadata + block * BLOCK_GRANULES;
+    size_t n = 0;
+    while (n < BLOCK_GRANULES) {
+      size_t granules = 1 + next_random() % max_granules;
+      if (granules > BLOCK_GRANULES - n)
+        granules = BLOCK_GRANULES - n;
+      uint8_t bit = (next_random() % 100 < live_percent) ? LIVE_BIT : DEAD_BIT;
+      memset(bytes + n, 0, granules);
+      bytes[n] = bit;
+      bytes[n + granules - 1] |= END_BIT;
+      n += granules;
+    }
+  }
+}
+
+#define MAX_OBJECT_GRANULES 512
+
+static size_t live_object_granules_bytewise(uint8_t *metadata) {
+  size_t n = 0;
+  while ((metadata[n] & END_BIT) == 0)
+    n++;
+  return n + 1;
+}
+
+// As mark_space_live_object_granules in whippet.h.
+static size_t live_object_granules(uint8_t *metadata) {
+  if (metadata[0] & END_BIT)
+    return 1;
+  return scan_for_byte_with_bits(metadata + 1, MAX_OBJECT_GRANULES - 1,
+                                 broadcast_byte(END_BIT)) + 2;
+}
+
+struct sweep_result {
+  size_t holes;
+  size_t free_granules;
+};
+
+static struct sweep_result sweep_blocks(uint8_t *metadata,
+                                        enum scan_bytes_kind kind) {
+  struct sweep_result result = { 0, 0 };
+  uint64_t live_mask = broadcast_byte(LIVE_BIT);
+  scan_bytes_kind = kind;
+  for (size_t block = 0; block < BLOCK_COUNT; block++) {
+    uint8_t *bytes = metadata + block * BLOCK_GRANULES;
+    size_t n = 0;
+    while (n < BLOCK_GRANULES) {
+      if (bytes[n] & LIVE_BIT) {
+        n += live_object_granules(bytes + n);
+        continue;
+      }
+      size_t hole = scan_for_byte_with_bits(bytes + n, BLOCK_GRANULES - n,
+                                            live_mask);
+      result.holes++;
+      result.free_granules += hole;
+      n += hole;
+    }
+  }
+  return result;
+}
+
+static const char *kind_name(enum scan_bytes_kind kind) {
+  switch (kind) {
+  case SCAN_BYTES_WORD: return "word";
+  case SCAN_BYTES_SSE2: return "sse2";
+  case SCAN_BYTES_AVX2: return "avx2";
+  default: abort();
+  }
+}
+
+// Fill METADATA with live objects of exactly GRANULES granules, then
+// time finding the extent of each one, as the sweeper does when
+// skipping over survivors and the evacuator does when copying.
+static int run_extents(uint8_t *metadata, size_t granules) {
+  size_t objects_per_block = BLOCK_GRANULES / granules;
+  for (size_t block = 0; block < BLOCK_COUNT; block++) {
+    uint8_t *bytes = metadata + block * BLOCK_GRANULES;
+    memset(bytes, 0, BLOCK_GRANULES);
+    for (size_t i = 0; i < objects_per_block; i++) {
+      bytes[i * granules] |= LIVE_BIT;
+      bytes[i * granules + granules - 1] |= END_BIT;
+    }
+  }
+
+  printf("extent of %zu-granule objects:\n", granules);
+  enum scan_bytes_kind kinds[] =
+    { SCAN_BYTES_WORD, SCAN_BYTES_SSE2, SCAN_BYTES_AVX2 };
+  for (size_t i = 0; i <= sizeof(kinds) / sizeof(kinds[0]); i++) {
+    int bytewise = i == sizeof(kinds) / sizeof(kinds[0]);
+    if (!bytewise) {
+      if (!scan_bytes_kind_supported(kinds[i]))
+        continue;
+      scan_bytes_kind = kinds[i];
+    }
+    size_t total = 0;
+    unsigned long start = current_time();
+    for (size_t j = 0; j < ITERATIONS; j++) {
+      for (size_t block = 0; block < BLOCK_COUNT; block++) {
+        uint8_t *bytes = metadata + block * BLOCK_GRANULES;
+        for (size_t k = 0; k < objects_per_block; k++) {
+          uint8_t *obj = bytes + k * granules;
+          total += bytewise
+            ? live_object_granules_bytewise(obj)
+            : live_object_granules(obj);
+        }
+      }
+    }
+    double usec = current_time() - start;
+    if (total != (size_t) ITERATIONS * BLOCK_COUNT * objects_per_block * granules) {
+      fprintf(stderr, "%zu-granule objects: %s computed %zu granules\n",
+              granules, bytewise ? "bytewise" : kind_name(kinds[i]), total);
+      return 0;
+    }
+    double objects = (double) ITERATIONS * BLOCK_COUNT * objects_per_block;
+    printf("  %s: %.3f msec, %.2f nsec/object\n",
+           bytewise ? "bytewise" : kind_name(kinds[i]), usec * 1e-3,
+           usec * 1e3 / objects);
+  }
+  return 1;
+}
+
+static int run(const char *what, uint8_t *metadata, size_t max_granules,
+               unsigned live_percent) {
+  fill_blocks(metadata, max_granules, live_percent);
+  struct sweep_result expected = sweep_blocks(metadata, SCAN_BYTES_WORD);
+  printf("%s: %zu holes, %.1f%% free\n", what, expected.holes,
+         expected.free_granules * 100.0 / (BLOCK_COUNT * BLOCK_GRANULES));
+
+  enum scan_bytes_kind kinds[] =
+    { SCAN_BYTES_WORD, SCAN_BYTES_SSE2, SCAN_BYTES_AVX2 };
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    if (!scan_bytes_kind_supported(kinds[i]))
+      continue;
+    struct sweep_result result = sweep_blocks(metadata, kinds[i]);
+    if (result.holes != expected.holes ||
+        result.free_granules != expected.free_granules) {
+      fprintf(stderr, "%s: %s found %zu holes (%zu granules), expected %zu (%zu)\n",
+              what, kind_name(kinds[i]), result.holes, result.free_granules,
+              expected.holes, expected.free_granules);
+      return 0;
+    }
+    unsigned long start = current_time();
+    for (size_t j = 0; j < ITERATIONS; j++)
+      sweep_blocks(metadata, kinds[i]);
+    double usec = current_time() - start;
+    double granules = (double) ITERATIONS * BLOCK_COUNT * BLOCK_GRANULES;
+    printf("  %s: %.3f msec, %.2f granules/nsec\n", kind_name(kinds[i]),
+           usec * 1e-3, granules / (usec * 1e3));
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  uint8_t *metadata = aligned_alloc(BLOCK_GRANULES,
+                                    BLOCK_COUNT * BLOCK_GRANULES);
+  if (!metadata) {
+    perror("allocating metadata failed");
+    return 1;
+  }
+
+  if (!run("dense", metadata, 4, 90)
+      || !run("sparse", metadata, 4, 5)
+      || !run("mixed", metadata, 16, 50))
+    return 1;
+
+  for (size_t granules = 1; granules <= MAX_OBJECT_GRANULES; granules *= 2)
+    if (!run_extents(metadata, granules))
+      return 1;
+
+  free(metadata);
+  return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Resource limits from the process's cgroup (v2 only).  A limit on an
+// enclosing cgroup applies too, so we take the lowest limit of the
+// process's cgroup and all of its ancestors.  Set GC_CGROUP to a
+// directory to read the limits from there instead, for example for
+// testing, or to 0 to ignore cgroups.
+//
+// The two kinds of limit have different defaults.  The CPU quota only
+// caps the number of tracing threads, so it applies unless GC_CGROUP is
+// 0.  Memory limits change how big the heap may get, so whippet.h only
+// reads them if GC_CGROUP is set, to 1 or to a directory.
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+// Read the first line of the file NAME in the cgroup directory DIR into
+// BUF.  Return 0 if there is no such file.
+static int cgroup_read_file(const char *dir, const char *name, char *buf,
+                            size_t size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  int ok = fgets(buf, size, f) != NULL;
+  fclose(f);
+  return ok;
+}
+
+// Return the lowest DIR_LIMIT of the process's cgroup and its
+// ancestors, where DIR_LIMIT returns SIZE_MAX for no limit.
+static size_t cgroup_lowest_limit(size_t (*dir_limit)(const char *dir)) {
+  const char *option = getenv("GC_CGROUP");
+  if (option && strcmp(option, "0") == 0)
+    return SIZE_MAX;
+  if (option && strcmp(option, "1") != 0)
+    return dir_limit(option);
+
+  // Our cgroup v2 path is on the line starting with "0::".
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (!f)
+    return SIZE_MAX;
+  char line[PATH_MAX];
+  char dir[PATH_MAX + sizeof(CGROUP_ROOT)];
+  dir[0] = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = 0;
+      snprintf(dir, sizeof(dir), "%s%s", CGROUP_ROOT, line + 3);
+      break;
+    }
+  }
+  fclose(f);
+
+  size_t limit = SIZE_MAX;
+  while (strlen(dir) > strlen(CGROUP_ROOT)) {
+    size_t limit_here = dir_limit(dir);
+    if (limit_here < limit)
+      limit = limit_here;
+    *strrchr(dir, '/') = 0;
+  }
+  return limit;
+}
+
+#endif // CGROUP_H
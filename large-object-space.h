@@ -185,6 +185,10 @@ static void* large_object_space_alloc(struct large_object_space *space,
       address_map_add(&space->predecessors, succ_succ, succ);
     }
     space->free_pages -= npages;
+    // Objects allocated while a collection is starting go to to-space
+    // and survive the collection; count them as live.  Between
+    // collections, the flip resets this count anyway.
+    space->live_pages_at_last_collection += npages;
   }
   pthread_mutex_unlock(&space->lock);
   return ret;
@@ -205,6 +209,7 @@ large_object_space_obtain_and_alloc(struct large_object_space *space,
   address_map_add(&space->predecessors, addr + bytes, addr);
   address_set_add(&space->to_space, addr);
   space->total_pages += npages;
+  space->live_pages_at_last_collection += npages;
   pthread_mutex_unlock(&space->lock);
 
   return ret;
@@ -1,12 +1,18 @@
 #ifndef PARALLEL_TRACER_H
 #define PARALLEL_TRACER_H
 
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "assert.h"
+#include "cgroup.h"
 #include "debug.h"
 #include "inline.h"
 #include "spin.h"
@@ -177,7 +183,7 @@ trace_deque_push_many(struct trace_deque *q, struct gcobj **objv, size_t count)
   size_t t = LOAD_ACQUIRE(&q->top);
   int active = LOAD_RELAXED(&q->active);
 
-  while (b - t > trace_buf_size(&q->bufs[active]) - count) /* Full queue. */
+  while (trace_buf_size(&q->bufs[active]) - (b - t) < count) /* Full queue. */
     active = trace_deque_grow(q, active, b, t);
 
   for (size_t i = 0; i < count; i++)
@@ -186,48 +192,32 @@ trace_deque_push_many(struct trace_deque *q, struct gcobj **objv, size_t count)
   STORE_RELAXED(&q->bottom, b + count);
 }
 
-static struct gcobj *
-trace_deque_try_pop(struct trace_deque *q) {
-  size_t b = LOAD_RELAXED(&q->bottom);
-  b = b - 1;
-  int active = LOAD_RELAXED(&q->active);
-  STORE_RELAXED(&q->bottom, b);
-  atomic_thread_fence(memory_order_seq_cst);
-  size_t t = LOAD_RELAXED(&q->top);
-  struct gcobj * x;
-  if (t <= b) { // Non-empty queue.
-    x = trace_buf_get(&q->bufs[active], b);
-    if (t == b) { // Single last element in queue.
-      if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
-                                                   memory_order_seq_cst,
-                                                   memory_order_relaxed))
-        // Failed race.
-        x = NULL;
-      STORE_RELAXED(&q->bottom, b + 1);
-    }
-  } else { // Empty queue.
-    x = NULL;
-    STORE_RELAXED(&q->bottom, b + 1);
-  }
-  return x;
-}
-
-static struct gcobj *
-trace_deque_steal(struct trace_deque *q) {
+// Steal up to half of the items in the deque, but no more than MAX,
+// into OBJV, claiming them all with one CAS on top.  This is only safe
+// because there is no pop from the bottom: all consumers, including
+// the deque's owner, take items from the top, so a successful CAS from T to T+N
+// gives us exclusive ownership of items T to T+N-1.
+static size_t
+trace_deque_steal_many(struct trace_deque *q, struct gcobj **objv,
+                       size_t max) {
   while (1) {
     size_t t = LOAD_ACQUIRE(&q->top);
     atomic_thread_fence(memory_order_seq_cst);
     size_t b = LOAD_ACQUIRE(&q->bottom);
     if (t >= b)
-      return NULL;
+      return 0;
+    size_t n = (b - t + 1) / 2;
+    if (n > max)
+      n = max;
     int active = LOAD_CONSUME(&q->active);
-    struct gcobj *x = x = trace_buf_get(&q->bufs[active], t);
-    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+    for (size_t i = 0; i < n; i++)
+      objv[i] = trace_buf_get(&q->bufs[active], t + i);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + n,
                                                  memory_order_seq_cst,
                                                  memory_order_relaxed))
       // Failed race.
       continue;
-    return x;
+    return n;
   }
 }
 
@@ -248,6 +238,9 @@ trace_deque_can_steal(struct trace_deque *q) {
 #define LOCAL_TRACE_QUEUE_SIZE 1024
 #define LOCAL_TRACE_QUEUE_MASK (LOCAL_TRACE_QUEUE_SIZE - 1)
 #define LOCAL_TRACE_QUEUE_SHARE_AMOUNT (LOCAL_TRACE_QUEUE_SIZE * 3 / 4)
+// Steal no more than this many objects at once, so that tracing what we
+// stole leaves space in the local queue before we have to share.
+#define LOCAL_TRACE_QUEUE_STEAL_AMOUNT (LOCAL_TRACE_QUEUE_SIZE / 4)
 struct local_trace_queue {
   size_t read;
   size_t write;
@@ -282,12 +275,20 @@ static inline struct gcobj *
 local_trace_queue_pop(struct local_trace_queue *q) {
   return q->data[q->read++ & LOCAL_TRACE_QUEUE_MASK];
 }
+// Fill an empty queue with up to half of the items in DEQUE.
+static inline size_t
+local_trace_queue_steal(struct local_trace_queue *q, struct trace_deque *deque) {
+  ASSERT(local_trace_queue_empty(q));
+  local_trace_queue_init(q);
+  q->write = trace_deque_steal_many(deque, q->data,
+                                    LOCAL_TRACE_QUEUE_STEAL_AMOUNT);
+  return q->write;
+}
 
 enum trace_worker_state {
   TRACE_WORKER_STOPPED,
   TRACE_WORKER_IDLE,
   TRACE_WORKER_TRACING,
-  TRACE_WORKER_STOPPING,
   TRACE_WORKER_DEAD
 };
 
@@ -296,23 +297,48 @@ struct trace_worker {
   struct heap *heap;
   size_t id;
   size_t steal_id;
+  uint32_t steal_seed;
+  size_t steal_attempts;
+  size_t steals;
+  size_t stolen_objects;
   pthread_t thread;
   enum trace_worker_state state;
-  pthread_mutex_t lock;
-  pthread_cond_t cond;
+  unsigned generation;
+  uint64_t start_nsec;
   struct trace_deque deque;
 };
 
-#define TRACE_WORKERS_MAX_COUNT 8
-
+// The thread that runs the collection is always worker 0: it traces
+// alongside the others instead of waiting for them, so there is one
+// thread fewer to wake, and with GC_TRACERS=1 there are no tracer
+// threads at all.  The threads for workers 1 and up are spawned lazily,
+// once a trace visits at least this many objects.  Until then, the
+// collector thread traces alone; short-lived processes with small heaps
+// never pay for the threads at all.
+#define TRACER_THREADS_THRESHOLD_OBJECTS (64 * 1024)
+
+// Workers sleep on futexes, both between traces and when they run out
+// of work during a trace.  To start a trace, the controller bumps the
+// generation and wakes all workers with one system call.  A worker that
+// shares work bumps the work sequence number, waking idle workers if
+// there are any; the last worker to go idle bumps it too, so that the
+// others see that the trace is done.
 struct tracer {
   atomic_size_t active_tracers;
   size_t worker_count;
+  int threads_started;
+  size_t last_trace_objects;
+  size_t next_root_worker;
   atomic_size_t running_tracers;
+  atomic_uint generation;
+  int stopping;
+  atomic_uint work_seq;
+  atomic_size_t idle_tracers;
+  uint64_t trace_start_nsec;
   long count;
   pthread_mutex_t lock;
   pthread_cond_t cond;
-  struct trace_worker workers[TRACE_WORKERS_MAX_COUNT];
+  struct trace_worker *workers;
 };
 
 struct local_tracer {
@@ -325,7 +351,61 @@ struct local_tracer {
 struct context;
 static inline struct tracer* heap_tracer(struct heap *heap);
 
-static size_t number_of_current_processors(void) { return 1; }
+static void
+tracer_futex_wait(atomic_uint *addr, unsigned val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+tracer_futex_wake_all(atomic_uint *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint64_t
+tracer_now_nsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// cpu.max holds "QUOTA PERIOD" in microseconds, or "max PERIOD" for no
+// limit.  A quota of several periods lets the cgroup keep that many
+// CPUs busy.
+static size_t cgroup_dir_cpu_limit(const char *dir) {
+  char buf[64];
+  if (!cgroup_read_file(dir, "cpu.max", buf, sizeof(buf)))
+    return SIZE_MAX;
+  char *end;
+  unsigned long long quota = strtoull(buf, &end, 10);
+  if (end == buf)
+    return SIZE_MAX;
+  unsigned long long period = strtoull(end, NULL, 10);
+  if (!period)
+    return SIZE_MAX;
+  size_t cpus = (quota + period - 1) / period;
+  return cpus ? cpus : 1;
+}
+
+// The number of CPUs that we may run on, further limited by the CPU
+// quota of our cgroup, if any.
+static size_t number_of_current_processors(void) {
+  size_t count = 0;
+  unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+  long bytes = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+  if (bytes > 0) {
+    for (size_t i = 0; i < bytes / sizeof(unsigned long); i++)
+      count += __builtin_popcountl(mask[i]);
+  } else {
+    // More than 1024 CPUs, perhaps.
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online > 0)
+      count = online;
+  }
+  size_t quota = cgroup_lowest_limit(cgroup_dir_cpu_limit);
+  if (quota < count)
+    count = quota;
+  return count ? count : 1;
+}
 
 static int
 trace_worker_init(struct trace_worker *worker, struct heap *heap,
@@ -333,45 +413,46 @@ trace_worker_init(struct trace_worker *worker, struct heap *heap,
   worker->heap = heap;
   worker->id = id;
   worker->steal_id = 0;
+  worker->steal_seed = id + 1;
   worker->thread = 0;
   worker->state = TRACE_WORKER_STOPPED;
-  pthread_mutex_init(&worker->lock, NULL);
-  pthread_cond_init(&worker->cond, NULL);
+  worker->generation = 0;
+  worker->start_nsec = 0;
   return trace_deque_init(&worker->deque);
 }
 
-static void trace_worker_trace(struct trace_worker *worker);
+static size_t trace_worker_trace(struct trace_worker *worker);
 
 static void*
 trace_worker_thread(void *data) {
   struct trace_worker *worker = data;
+  struct tracer *tracer = heap_tracer(worker->heap);
 
-  pthread_mutex_lock(&worker->lock);
   while (1) {
-    switch (worker->state) {
-    case TRACE_WORKER_IDLE:
-      pthread_cond_wait(&worker->cond, &worker->lock);
-      break;
-    case TRACE_WORKER_TRACING:
-      trace_worker_trace(worker);
-      worker->state = TRACE_WORKER_IDLE;
-      break;
-    case TRACE_WORKER_STOPPING:
+    unsigned generation;
+    while ((generation = atomic_load_explicit(&tracer->generation,
+                                              memory_order_acquire))
+           == worker->generation)
+      tracer_futex_wait(&tracer->generation, worker->generation);
+    worker->generation = generation;
+    if (tracer->stopping) {
       worker->state = TRACE_WORKER_DEAD;
-      pthread_mutex_unlock(&worker->lock);
       return NULL;
-    default:
-      abort();
     }
+    worker->start_nsec = tracer_now_nsec();
+    worker->state = TRACE_WORKER_TRACING;
+    trace_worker_trace(worker);
+    worker->state = TRACE_WORKER_IDLE;
   }
 }
 
 static int
 trace_worker_spawn(struct trace_worker *worker) {
-  pthread_mutex_lock(&worker->lock);
+  struct tracer *tracer = heap_tracer(worker->heap);
   ASSERT(worker->state == TRACE_WORKER_STOPPED);
   worker->state = TRACE_WORKER_IDLE;
-  pthread_mutex_unlock(&worker->lock);
+  worker->generation = atomic_load_explicit(&tracer->generation,
+                                            memory_order_relaxed);
 
   if (pthread_create(&worker->thread, NULL, trace_worker_thread, worker)) {
     perror("spawning tracer thread failed");
@@ -382,17 +463,6 @@ trace_worker_spawn(struct trace_worker *worker) {
   return 1;
 }
 
-static void
-trace_worker_request_trace(struct trace_worker *worker) {
-  struct tracer *tracer = heap_tracer(worker->heap);
-    
-  pthread_mutex_lock(&worker->lock);
-  ASSERT(worker->state == TRACE_WORKER_IDLE);
-  worker->state = TRACE_WORKER_TRACING;
-  pthread_cond_signal(&worker->cond);
-  pthread_mutex_unlock(&worker->lock);
-}  
-
 static void
 trace_worker_finished_tracing(struct trace_worker *worker) {
   // Signal controller that we are done with tracing.
@@ -406,20 +476,24 @@ trace_worker_finished_tracing(struct trace_worker *worker) {
   }
 }
 
+// Wake all workers, either to trace or, if STOPPING, to exit.  The
+// caller must have set up the trace.
 static void
-trace_worker_request_stop(struct trace_worker *worker) {
-  pthread_mutex_lock(&worker->lock);
-  ASSERT(worker->state == TRACE_WORKER_IDLE);
-  worker->state = TRACE_WORKER_STOPPING;
-  pthread_cond_signal(&worker->cond);
-  pthread_mutex_unlock(&worker->lock);
-}  
+tracer_wake_workers(struct tracer *tracer, int stopping) {
+  tracer->stopping = stopping;
+  tracer->trace_start_nsec = tracer_now_nsec();
+  atomic_fetch_add_explicit(&tracer->generation, 1, memory_order_release);
+  tracer_futex_wake_all(&tracer->generation);
+}
 
 static int
 tracer_init(struct heap *heap) {
   struct tracer *tracer = heap_tracer(heap);
   atomic_init(&tracer->active_tracers, 0);
   atomic_init(&tracer->running_tracers, 0);
+  atomic_init(&tracer->generation, 0);
+  atomic_init(&tracer->work_seq, 0);
+  atomic_init(&tracer->idle_tracers, 0);
   tracer->count = 0;
   pthread_mutex_init(&tracer->lock, NULL);
   pthread_cond_init(&tracer->cond, NULL);
@@ -428,23 +502,47 @@ tracer_init(struct heap *heap) {
     desired_worker_count = atoi(getenv("GC_TRACERS"));
   if (desired_worker_count == 0)
     desired_worker_count = number_of_current_processors();
-  if (desired_worker_count > TRACE_WORKERS_MAX_COUNT)
-    desired_worker_count = TRACE_WORKERS_MAX_COUNT;
+  tracer->workers = calloc(desired_worker_count, sizeof(struct trace_worker));
+  if (!tracer->workers) {
+    perror("allocating tracer workers failed");
+    return 0;
+  }
   for (size_t i = 0; i < desired_worker_count; i++) {
     if (!trace_worker_init(&tracer->workers[i], heap, tracer, i))
       break;
-    if (trace_worker_spawn(&tracer->workers[i]))
-      tracer->worker_count++;
-    else
-      break;
+    tracer->worker_count++;
   }
   return tracer->worker_count > 0;
 }
 
+static void
+tracer_start_threads(struct tracer *tracer) {
+  for (size_t i = 1; i < tracer->worker_count; i++) {
+    if (!trace_worker_spawn(&tracer->workers[i])) {
+      // Carry on with the threads that we have; if we have none, keep
+      // tracing on the collector thread alone.
+      tracer->worker_count = i;
+      break;
+    }
+  }
+  tracer->threads_started = tracer->worker_count > 1;
+}
+
 static void tracer_prepare(struct heap *heap) {
   struct tracer *tracer = heap_tracer(heap);
-  for (size_t i = 0; i < tracer->worker_count; i++)
-    tracer->workers[i].steal_id = 0;
+  // Decide whether to use the tracer threads before any roots are
+  // enqueued, as that determines which deques the roots go to.
+  if (!tracer->threads_started && tracer->worker_count > 1
+      && tracer->last_trace_objects >= TRACER_THREADS_THRESHOLD_OBJECTS)
+    tracer_start_threads(tracer);
+  // Idle workers check for work starting at their neighbour's deque,
+  // so that they don't all converge on the same victim.
+  for (size_t i = 0; i < tracer->worker_count; i++) {
+    struct trace_worker *worker = &tracer->workers[i];
+    worker->steal_id = i;
+    worker->steal_attempts = worker->steals = worker->stolen_objects = 0;
+  }
+  tracer->next_root_worker = 0;
 }
 static void tracer_release(struct heap *heap) {
   struct tracer *tracer = heap_tracer(heap);
@@ -458,11 +556,21 @@ static inline void trace_one(struct gcobj *obj, void *trace_data) ALWAYS_INLINE;
 static inline int trace_edge(struct heap *heap,
                              struct gc_edge edge) ALWAYS_INLINE;
 
+// Tell idle workers that there may be new work, or that the trace is
+// done.
+static void
+tracer_publish_work(struct tracer *tracer) {
+  atomic_fetch_add(&tracer->work_seq, 1);
+  if (atomic_load(&tracer->idle_tracers))
+    tracer_futex_wake_all(&tracer->work_seq);
+}
+
 static inline void
 tracer_share(struct local_tracer *trace) {
   DEBUG("tracer #%zu: sharing\n", trace->worker->id);
   for (size_t i = 0; i < LOCAL_TRACE_QUEUE_SHARE_AMOUNT; i++)
     trace_deque_push(trace->share_deque, local_trace_queue_pop(&trace->local));
+  tracer_publish_work(heap_tracer(trace->heap));
 }
 
 static inline void
@@ -475,29 +583,52 @@ tracer_visit(struct gc_edge edge, void *trace_data) {
   }
 }
 
-static struct gcobj *
-tracer_steal_from_worker(struct tracer *tracer, size_t id) {
-  ASSERT(id < tracer->worker_count);
-  return trace_deque_steal(&tracer->workers[id].deque);
-}
-
 static int
 tracer_can_steal_from_worker(struct tracer *tracer, size_t id) {
   ASSERT(id < tracer->worker_count);
   return trace_deque_can_steal(&tracer->workers[id].deque);
 }
 
-static struct gcobj *
-trace_worker_steal_from_any(struct trace_worker *worker, struct tracer *tracer) {
-  size_t steal_id = worker->steal_id;
-  for (size_t i = 0; i < tracer->worker_count; i++) {
-    steal_id = (steal_id + 1) % tracer->worker_count;
+static inline uint32_t
+trace_worker_next_random(struct trace_worker *worker) {
+  // xorshift32.
+  uint32_t x = worker->steal_seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return worker->steal_seed = x;
+}
+
+// Until the worker threads are started, the collector thread traces
+// alone as worker 0, so there is only one deque to look at.
+static inline size_t
+tracer_active_worker_count(struct tracer *tracer) {
+  return tracer->threads_started ? tracer->worker_count : 1;
+}
+
+// Steal a batch of objects from some other worker into our local queue.
+// We try the workers in order from a random starting point, so that
+// thieves spread out over the victims instead of all hitting the same
+// one.
+static size_t
+trace_worker_steal_from_any(struct trace_worker *worker, struct tracer *tracer,
+                            struct local_trace_queue *local) {
+  size_t count = tracer_active_worker_count(tracer);
+  size_t start = trace_worker_next_random(worker) % count;
+  for (size_t i = 0; i < count; i++) {
+    size_t steal_id = (start + i) % count;
+    if (steal_id == worker->id)
+      continue;
     DEBUG("tracer #%zu: stealing from #%zu\n", worker->id, steal_id);
-    struct gcobj * obj = tracer_steal_from_worker(tracer, steal_id);
-    if (obj) {
-      DEBUG("tracer #%zu: stealing got %p\n", worker->id, obj);
+    worker->steal_attempts++;
+    size_t n = local_trace_queue_steal(local,
+                                       &tracer->workers[steal_id].deque);
+    if (n) {
+      DEBUG("tracer #%zu: stole %zu objects\n", worker->id, n);
       worker->steal_id = steal_id;
-      return obj;
+      worker->steals++;
+      worker->stolen_objects += n;
+      return n;
     }
   }
   DEBUG("tracer #%zu: failed to steal\n", worker->id);
@@ -508,8 +639,9 @@ static int
 trace_worker_can_steal_from_any(struct trace_worker *worker, struct tracer *tracer) {
   size_t steal_id = worker->steal_id;
   DEBUG("tracer #%zu: checking if any worker has tasks\n", worker->id);
-  for (size_t i = 0; i < tracer->worker_count; i++) {
-    steal_id = (steal_id + 1) % tracer->worker_count;
+  size_t count = tracer_active_worker_count(tracer);
+  for (size_t i = 0; i < count; i++) {
+    steal_id = (steal_id + 1) % count;
     int res = tracer_can_steal_from_worker(tracer, steal_id);
     if (res) {
       DEBUG("tracer #%zu: worker #%zu has tasks!\n", worker->id, steal_id);
@@ -521,50 +653,76 @@ trace_worker_can_steal_from_any(struct trace_worker *worker, struct tracer *trac
   return 0;
 }
 
+// Idle workers spin this many times, checking for work, before going to
+// sleep until more work is published.
+#define TRACER_IDLE_SPIN_COUNT 10
+
 static int
 trace_worker_check_termination(struct trace_worker *worker,
                               struct tracer *tracer) {
   // We went around all workers and nothing.  Enter termination phase.
   if (atomic_fetch_sub_explicit(&tracer->active_tracers, 1,
                                 memory_order_relaxed) == 1) {
-    DEBUG("  ->> tracer #%zu: DONE (no spinning) <<-\n", worker->id);
+    DEBUG("  ->> tracer #%zu: DONE (no waiting) <<-\n", worker->id);
+    tracer_publish_work(tracer);
     return 1;
   }
 
+  // Register as idle before reading the work sequence number, so that
+  // anyone who publishes work after we read it will wake us.
+  atomic_fetch_add(&tracer->idle_tracers, 1);
+  int done;
   for (size_t spin_count = 0;; spin_count++) {
+    unsigned seq = atomic_load(&tracer->work_seq);
     if (trace_worker_can_steal_from_any(worker, tracer)) {
       atomic_fetch_add_explicit(&tracer->active_tracers, 1,
                                 memory_order_relaxed);
-      return 0;
+      done = 0;
+      break;
     }
     if (atomic_load_explicit(&tracer->active_tracers,
                              memory_order_relaxed) == 0) {
       DEBUG("  ->> tracer #%zu: DONE <<-\n", worker->id);
-      return 1;
+      done = 1;
+      break;
+    }
+    if (spin_count < TRACER_IDLE_SPIN_COUNT) {
+      DEBUG("tracer #%zu: spinning #%zu\n", worker->id, spin_count);
+      yield_for_spin(spin_count);
+    } else {
+      DEBUG("tracer #%zu: sleeping\n", worker->id);
+      tracer_futex_wait(&tracer->work_seq, seq);
     }
-    // spin
-    DEBUG("tracer #%zu: spinning #%zu\n", worker->id, spin_count);
-    yield_for_spin(spin_count);
   }
+  atomic_fetch_sub(&tracer->idle_tracers, 1);
+  return done;
 }
 
-static struct gcobj *
+// Refill our empty local queue, returning 0 when the trace is done.
+static size_t
 trace_worker_steal(struct local_tracer *trace) {
   struct tracer *tracer = heap_tracer(trace->heap);
   struct trace_worker *worker = trace->worker;
 
   while (1) {
+    // Work in our own deque is either roots that we were given or
+    // objects that we shared.  We take it back from the top, like any
+    // thief, as that is what lets thieves take batches.
+    size_t n = local_trace_queue_steal(&trace->local, &worker->deque);
+    if (n)
+      return n;
+
     DEBUG("tracer #%zu: trying to steal\n", worker->id);
-    struct gcobj *obj = trace_worker_steal_from_any(worker, tracer);
-    if (obj)
-      return obj;
+    n = trace_worker_steal_from_any(worker, tracer, &trace->local);
+    if (n)
+      return n;
 
     if (trace_worker_check_termination(worker, tracer))
-      return NULL;
+      return 0;
   }
 }
 
-static void
+static size_t
 trace_worker_trace(struct trace_worker *worker) {
   struct local_tracer trace;
   trace.worker = worker;
@@ -575,39 +733,86 @@ trace_worker_trace(struct trace_worker *worker) {
   size_t n = 0;
   DEBUG("tracer #%zu: running trace loop\n", worker->id);
   while (1) {
-    struct gcobj * obj;
-    if (!local_trace_queue_empty(&trace.local)) {
-      obj = local_trace_queue_pop(&trace.local);
-    } else {
-      obj = trace_worker_steal(&trace);
-      if (!obj)
-        break;
-    }
-    trace_one(obj, &trace);
+    if (local_trace_queue_empty(&trace.local) && !trace_worker_steal(&trace))
+      break;
+    trace_one(local_trace_queue_pop(&trace.local), &trace);
     n++;
   }
   DEBUG("tracer #%zu: done tracing, %zu objects traced\n", worker->id, n);
 
   trace_worker_finished_tracing(worker);
+  return n;
+}
+
+// Roots are enqueued by the controlling thread before the trace starts,
+// so it may push onto any worker's deque.  We deal them out round-robin,
+// so that each worker starts with some work of its own instead of all
+// of them stealing from worker 0.  If the trace will run on the
+// collector thread alone, everything goes to worker 0.
+static inline struct trace_deque *
+tracer_next_root_deque(struct tracer *tracer) {
+  size_t id = tracer->next_root_worker;
+  tracer->next_root_worker = (id + 1) % tracer_active_worker_count(tracer);
+  return &tracer->workers[id].deque;
 }
 
 static inline void
 tracer_enqueue_root(struct tracer *tracer, struct gcobj *obj) {
-  struct trace_deque *worker0_deque = &tracer->workers[0].deque;
-  trace_deque_push(worker0_deque, obj);
+  trace_deque_push(tracer_next_root_deque(tracer), obj);
 }
 
+// Buffers of roots marked by stopping mutators may be large; split them
+// into chunks, one per worker, but not so small that the split costs
+// more than it saves.
+#define TRACER_ROOT_CHUNK_MIN_SIZE 64
+
 static inline void
 tracer_enqueue_roots(struct tracer *tracer, struct gcobj **objv,
                      size_t count) {
-  struct trace_deque *worker0_deque = &tracer->workers[0].deque;
-  trace_deque_push_many(worker0_deque, objv, count);
+  size_t workers = tracer_active_worker_count(tracer);
+  size_t chunk = (count + workers - 1) / workers;
+  if (chunk < TRACER_ROOT_CHUNK_MIN_SIZE)
+    chunk = TRACER_ROOT_CHUNK_MIN_SIZE;
+  while (count) {
+    size_t n = count < chunk ? count : chunk;
+    trace_deque_push_many(tracer_next_root_deque(tracer), objv, n);
+    objv += n;
+    count -= n;
+  }
+}
+
+static void
+tracer_print_stats(struct tracer *tracer) {
+  size_t attempts = 0, steals = 0, stolen = 0;
+  uint64_t last_start_nsec = tracer->trace_start_nsec;
+  for (size_t i = 0; i < tracer->worker_count; i++) {
+    struct trace_worker *worker = &tracer->workers[i];
+    attempts += worker->steal_attempts;
+    steals += worker->steals;
+    stolen += worker->stolen_objects;
+    if (worker->start_nsec > last_start_nsec)
+      last_start_nsec = worker->start_nsec;
+  }
+  fprintf(stderr, "tracer steals: %zu of %zu attempts, %.1f objects per steal\n",
+          steals, attempts, steals ? (double) stolen / steals : 0.0);
+  fprintf(stderr, "tracer start: all %zu workers running after %.1f usec\n",
+          tracer->worker_count,
+          (last_start_nsec - tracer->trace_start_nsec) * 1e-3);
 }
 
 static inline void
 tracer_trace(struct heap *heap) {
   struct tracer *tracer = heap_tracer(heap);
 
+  if (!tracer->threads_started) {
+    DEBUG("starting trace on collector thread\n");
+    atomic_store_explicit(&tracer->active_tracers, 1, memory_order_release);
+    atomic_store_explicit(&tracer->running_tracers, 1, memory_order_release);
+    tracer->last_trace_objects = trace_worker_trace(&tracer->workers[0]);
+    DEBUG("trace finished\n");
+    return;
+  }
+
   pthread_mutex_lock(&tracer->lock);
   long trace_count = tracer->count;
   pthread_mutex_unlock(&tracer->lock);
@@ -618,8 +823,12 @@ tracer_trace(struct heap *heap) {
                         memory_order_release);
   atomic_store_explicit(&tracer->running_tracers, tracer->worker_count,
                         memory_order_release);
-  for (size_t i = 0; i < tracer->worker_count; i++)
-    trace_worker_request_trace(&tracer->workers[i]);
+  tracer_wake_workers(tracer, 0);
+
+  // Trace as worker 0 until the trace terminates, then wait for the
+  // other workers to finish up.  If we are the last to finish, we bump
+  // the count ourselves and don't wait.
+  trace_worker_trace(&tracer->workers[0]);
 
   DEBUG("waiting on tracers\n");
 
@@ -629,6 +838,7 @@ tracer_trace(struct heap *heap) {
   pthread_mutex_unlock(&tracer->lock);
 
   DEBUG("trace finished\n");
+  tracer_print_stats(tracer);
 }
 
 #endif // PARALLEL_TRACER_H
@@ -42,9 +42,23 @@ static Quad* make_tree(struct mutator *mut, int depth) {
     return allocate_quad(mut);
   } else {
     QuadHandle kids[4] = { { NULL }, };
-    for (size_t i = 0; i < 4; i++) {
-      HANDLE_SET(kids[i], make_tree(mut, depth-1));
-      PUSH_HANDLE(mut, kids[i]);
+    if (depth == 1) {
+      // Allocate leaves in bulk.  Only the first allocation of a batch
+      // can collect, so root each batch before asking for the next.
+      Quad *leaves[4];
+      for (size_t i = 0; i < 4; ) {
+        size_t count = allocate_many(mut, ALLOC_KIND_QUAD, sizeof (Quad),
+                                     4 - i, (void**)&leaves[i]);
+        for (; count; count--, i++) {
+          HANDLE_SET(kids[i], leaves[i]);
+          PUSH_HANDLE(mut, kids[i]);
+        }
+      }
+    } else {
+      for (size_t i = 0; i < 4; i++) {
+        HANDLE_SET(kids[i], make_tree(mut, depth-1));
+        PUSH_HANDLE(mut, kids[i]);
+      }
     }
 
     Quad *result = allocate_quad(mut);
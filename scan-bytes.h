@@ -0,0 +1,188 @@
+#ifndef SCAN_BYTES_H
+#define SCAN_BYTES_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_BYTES_X86 1
+#endif
+
+#include "assert.h"
+#include "inline.h"
+
+// Sweeping a block for holes is a matter of finding the first byte in
+// the metadata table that has any of the "live" bits set.  The
+// metadata table has one byte per granule, so a 64 kB block has 4096
+// bytes of metadata; going byte-by-byte is slow.  Instead we compare a
+// word at a time, or on x86 machines that support it, 16 or 32 bytes
+// at a time using SSE2 or AVX2.  The choice is made once at run-time
+// by scan_bytes_init.
+//
+// All implementations make aligned loads, possibly reading a few bytes
+// before the start of the range and after its end; these reads never
+// cross a page boundary.
+
+enum scan_bytes_kind {
+  SCAN_BYTES_WORD,
+  SCAN_BYTES_SSE2,
+  SCAN_BYTES_AVX2
+};
+
+static enum scan_bytes_kind scan_bytes_kind = SCAN_BYTES_WORD;
+
+static inline uint64_t broadcast_byte(uint8_t byte) {
+  uint64_t result = byte;
+  return result * 0x0101010101010101ULL;
+}
+
+static inline uint64_t load_eight_aligned_bytes(uint8_t *mark) {
+  ASSERT(((uintptr_t)mark & 7) == 0);
+  uint8_t * __attribute__((aligned(8))) aligned_mark = mark;
+  uint64_t word;
+  memcpy(&word, aligned_mark, 8);
+#ifdef WORDS_BIGENDIAN
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+static inline size_t count_zero_bytes(uint64_t bytes) {
+  return bytes ? (__builtin_ctzll(bytes) / 8) : sizeof(bytes);
+}
+
+static inline size_t scan_bytes_clamp(size_t n, size_t limit) {
+  return n < limit ? n : limit;
+}
+
+// Return the index of the first byte in [0, LIMIT) that has any bit of
+// BITS set, or LIMIT if there is none.  BITS is a byte broadcast to all
+// eight bytes of a word, as by broadcast_byte.
+static size_t scan_for_byte_with_bits_word(uint8_t *ptr, size_t limit,
+                                           uint64_t bits) {
+  size_t n = 0;
+  // If we have a hole, it is likely to be more that 8 granules long.
+  // Assuming that it's better to make aligned loads, first we align the
+  // sweep pointer, then we load aligned mark words.
+  size_t unaligned = ((uintptr_t) ptr) & 7;
+  if (unaligned) {
+    uint64_t bytes = load_eight_aligned_bytes(ptr - unaligned) >> (unaligned * 8);
+    bytes &= bits;
+    if (bytes)
+      return scan_bytes_clamp(count_zero_bytes(bytes), limit);
+    n += 8 - unaligned;
+  }
+
+  for(; n < limit; n += 8) {
+    uint64_t bytes = load_eight_aligned_bytes(ptr + n);
+    bytes &= bits;
+    if (bytes)
+      return scan_bytes_clamp(n + count_zero_bytes(bytes), limit);
+  }
+
+  return limit;
+}
+
+#ifdef SCAN_BYTES_X86
+
+__attribute__((target("sse2")))
+static size_t scan_for_byte_with_bits_sse2(uint8_t *ptr, size_t limit,
+                                           uint64_t bits) {
+  __m128i mask = _mm_set1_epi64x(bits);
+  __m128i zero = _mm_setzero_si128();
+  size_t n = 0;
+  size_t unaligned = ((uintptr_t) ptr) & 15;
+  if (unaligned) {
+    __m128i v = _mm_load_si128((__m128i*)(ptr - unaligned));
+    __m128i dead = _mm_cmpeq_epi8(_mm_and_si128(v, mask), zero);
+    uint32_t live = ~(uint32_t)_mm_movemask_epi8(dead) & 0xffff;
+    live >>= unaligned;
+    if (live)
+      return scan_bytes_clamp(__builtin_ctz(live), limit);
+    n += 16 - unaligned;
+  }
+
+  for (; n < limit; n += 16) {
+    __m128i v = _mm_load_si128((__m128i*)(ptr + n));
+    __m128i dead = _mm_cmpeq_epi8(_mm_and_si128(v, mask), zero);
+    uint32_t live = ~(uint32_t)_mm_movemask_epi8(dead) & 0xffff;
+    if (live)
+      return scan_bytes_clamp(n + __builtin_ctz(live), limit);
+  }
+
+  return limit;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_for_byte_with_bits_avx2(uint8_t *ptr, size_t limit,
+                                           uint64_t bits) {
+  __m256i mask = _mm256_set1_epi64x(bits);
+  __m256i zero = _mm256_setzero_si256();
+  size_t n = 0;
+  size_t unaligned = ((uintptr_t) ptr) & 31;
+  if (unaligned) {
+    __m256i v = _mm256_load_si256((__m256i*)(ptr - unaligned));
+    __m256i dead = _mm256_cmpeq_epi8(_mm256_and_si256(v, mask), zero);
+    uint32_t live = ~(uint32_t)_mm256_movemask_epi8(dead);
+    live >>= unaligned;
+    if (live)
+      return scan_bytes_clamp(__builtin_ctz(live), limit);
+    n += 32 - unaligned;
+  }
+
+  for (; n < limit; n += 32) {
+    __m256i v = _mm256_load_si256((__m256i*)(ptr + n));
+    __m256i dead = _mm256_cmpeq_epi8(_mm256_and_si256(v, mask), zero);
+    uint32_t live = ~(uint32_t)_mm256_movemask_epi8(dead);
+    if (live)
+      return scan_bytes_clamp(n + __builtin_ctz(live), limit);
+  }
+
+  return limit;
+}
+
+#endif // SCAN_BYTES_X86
+
+static int scan_bytes_kind_supported(enum scan_bytes_kind kind) {
+  switch (kind) {
+  case SCAN_BYTES_WORD:
+    return 1;
+#ifdef SCAN_BYTES_X86
+  case SCAN_BYTES_SSE2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+  case SCAN_BYTES_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
+  }
+}
+
+static void scan_bytes_init(void) {
+  if (scan_bytes_kind_supported(SCAN_BYTES_AVX2))
+    scan_bytes_kind = SCAN_BYTES_AVX2;
+  else if (scan_bytes_kind_supported(SCAN_BYTES_SSE2))
+    scan_bytes_kind = SCAN_BYTES_SSE2;
+  else
+    scan_bytes_kind = SCAN_BYTES_WORD;
+}
+
+static inline size_t scan_for_byte_with_bits(uint8_t *ptr, size_t limit,
+                                             uint64_t bits) {
+#ifdef SCAN_BYTES_X86
+  switch (scan_bytes_kind) {
+  case SCAN_BYTES_AVX2:
+    return scan_for_byte_with_bits_avx2(ptr, limit, bits);
+  case SCAN_BYTES_SSE2:
+    return scan_for_byte_with_bits_sse2(ptr, limit, bits);
+  default:
+    break;
+  }
+#endif
+  return scan_for_byte_with_bits_word(ptr, limit, bits);
+}
+
+#endif // SCAN_BYTES_H
@@ -227,8 +227,8 @@ static void* allocate_large(struct mutator *mut, enum alloc_kind kind,
   return ret;
 }
 
-static inline void* allocate(struct mutator *mut, enum alloc_kind kind,
-                             size_t size) {
+static inline void* allocate_object(struct mutator *mut, enum alloc_kind kind,
+                                    size_t size, int pointerless) {
   if (size >= LARGE_OBJECT_THRESHOLD)
     return allocate_large(mut, kind, size);
 
@@ -244,15 +244,47 @@ static inline void* allocate(struct mutator *mut, enum alloc_kind kind,
     void *ret = (void *)addr;
     uintptr_t *header_word = ret;
     *header_word = kind;
-    // FIXME: Allow allocator to avoid initializing pointerless memory?
-    // if (kind == NODE)
-    clear_memory(addr + sizeof(uintptr_t), size - sizeof(uintptr_t));
+    // Pointerless objects are left uninitialized.
+    if (!pointerless)
+      clear_memory(addr + sizeof(uintptr_t), size - sizeof(uintptr_t));
     return ret;
   }
 }
+static inline void* allocate(struct mutator *mut, enum alloc_kind kind,
+                             size_t size) {
+  return allocate_object(mut, kind, size, 0);
+}
 static inline void* allocate_pointerless(struct mutator *mut,
                                          enum alloc_kind kind, size_t size) {
-  return allocate(mut, kind, size);
+  return allocate_object(mut, kind, size, 1);
+}
+
+// Allocate up to N objects of the same KIND and SIZE, storing them in
+// OBJS, and return how many were allocated, which is at least 1.  Only
+// the first allocation may cause a collection.
+static inline size_t allocate_many(struct mutator *mut, enum alloc_kind kind,
+                                   size_t size, size_t n, void **objs) {
+  if (size >= LARGE_OBJECT_THRESHOLD) {
+    objs[0] = allocate_large(mut, kind, size);
+    return 1;
+  }
+
+  struct semi_space *space = mutator_semi_space(mut);
+  size_t bytes = align_up(size, ALIGNMENT);
+  if (space->limit - space->hp < bytes)
+    collect_for_alloc(mut, bytes);
+
+  size_t fit = (space->limit - space->hp) / bytes;
+  size_t batch = fit < n ? fit : n;
+  uintptr_t addr = space->hp;
+  space->hp += batch * bytes;
+  clear_memory(addr, batch * bytes);
+  for (size_t i = 0; i < batch; i++) {
+    uintptr_t *header_word = (uintptr_t*)(addr + i * bytes);
+    *header_word = kind;
+    objs[i] = header_word;
+  }
+  return batch;
 }
 
 static inline void init_field(void **addr, void *val) {
@@ -1,16 +1,21 @@
+#include <math.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "assert.h"
+#include "cgroup.h"
 #include "debug.h"
 #include "inline.h"
 #include "large-object-space.h"
 #include "precise-roots.h"
+#include "scan-bytes.h"
 #ifdef GC_PARALLEL_TRACE
 #include "parallel-tracer.h"
 #else
@@ -18,12 +23,52 @@
 #endif
 #include "spin.h"
 
-#define GRANULE_SIZE 16
+// The heap geometry is fixed at compile time.  By default we have
+// 16-byte granules, 64 kB blocks, and 4 MB slabs.  Define one of these
+// to select another supported profile instead:
+//
+//  - GC_GEOMETRY_GRANULE_8: 8-byte granules, as on 32-bit targets.
+//    Objects waste less space to rounding, but each block needs twice
+//    as much metadata.
+//
+//  - GC_GEOMETRY_BLOCK_32K: 32 kB blocks, to make blocks more likely
+//    to be empty or evacuation candidates.  The slab layout only has
+//    room for block summaries if 16 of 128 blocks per slab are set
+//    aside for metadata, instead of 4 of 64, half of them unused.
+//
+//  - GC_GEOMETRY_SLAB_2M: 2 MB slabs, one per transparent huge page.
+//    The heap grows and shrinks in smaller steps, but with
+//    GC_HUGE_PAGES, returning any memory to the OS splits a slab's
+//    huge page, as that page also holds the slab's metadata.
+//
+// Object size thresholds are the same in all profiles.
+#if defined(GC_GEOMETRY_GRANULE_8)
+#define GRANULE_SIZE_LOG_2 3
+#define BLOCK_SIZE_LOG_2 16
+#define SLAB_SIZE_LOG_2 22
+#define META_BLOCKS_PER_SLAB 8
+#elif defined(GC_GEOMETRY_BLOCK_32K)
 #define GRANULE_SIZE_LOG_2 4
+#define BLOCK_SIZE_LOG_2 15
+#define SLAB_SIZE_LOG_2 22
+#define META_BLOCKS_PER_SLAB 16
+#elif defined(GC_GEOMETRY_SLAB_2M)
+#define GRANULE_SIZE_LOG_2 4
+#define BLOCK_SIZE_LOG_2 16
+#define SLAB_SIZE_LOG_2 21
+#define META_BLOCKS_PER_SLAB 2
+#else
+#define GRANULE_SIZE_LOG_2 4
+#define BLOCK_SIZE_LOG_2 16
+#define SLAB_SIZE_LOG_2 22
+#define META_BLOCKS_PER_SLAB 4
+#endif
+
+#define GRANULE_SIZE (1 << GRANULE_SIZE_LOG_2)
 #define MEDIUM_OBJECT_THRESHOLD 256
-#define MEDIUM_OBJECT_GRANULE_THRESHOLD 16
+#define MEDIUM_OBJECT_GRANULE_THRESHOLD (MEDIUM_OBJECT_THRESHOLD / GRANULE_SIZE)
 #define LARGE_OBJECT_THRESHOLD 8192
-#define LARGE_OBJECT_GRANULE_THRESHOLD 512
+#define LARGE_OBJECT_GRANULE_THRESHOLD (LARGE_OBJECT_THRESHOLD / GRANULE_SIZE)
 
 STATIC_ASSERT_EQ(GRANULE_SIZE, 1 << GRANULE_SIZE_LOG_2);
 STATIC_ASSERT_EQ(MEDIUM_OBJECT_THRESHOLD,
@@ -42,7 +87,9 @@ STATIC_ASSERT_EQ(LARGE_OBJECT_THRESHOLD,
 // bit.)  Then there's a "remembered" bit, indicating that the object
 // should be scanned for references to the nursery.  If the remembered
 // bit is set, the corresponding remset byte should also be set in the
-// slab (see below).
+// slab (see below).  Finally there's a "pointerless" bit, for objects
+// that have no fields to trace: these are marked, but never enqueued
+// for tracing.
 //
 // Getting back to mark bits -- because we want to allow for
 // conservative roots, we need to know whether an address indicates an
@@ -71,7 +118,7 @@ enum metadata_byte {
   METADATA_BYTE_END = 16,
   METADATA_BYTE_PINNED = 32,
   METADATA_BYTE_REMEMBERED = 64,
-  METADATA_BYTE_UNUSED = 128
+  METADATA_BYTE_POINTERLESS = 128
 };
 
 static uint8_t rotate_dead_survivor_marked(uint8_t mask) {
@@ -80,11 +127,10 @@ static uint8_t rotate_dead_survivor_marked(uint8_t mask) {
   return ((mask << 1) | (mask >> 2)) & all;
 }
 
-#define SLAB_SIZE (4 * 1024 * 1024)
-#define BLOCK_SIZE (64 * 1024)
+#define SLAB_SIZE (1 << SLAB_SIZE_LOG_2)
+#define BLOCK_SIZE (1 << BLOCK_SIZE_LOG_2)
 #define METADATA_BYTES_PER_BLOCK (BLOCK_SIZE / GRANULE_SIZE)
 #define BLOCKS_PER_SLAB (SLAB_SIZE / BLOCK_SIZE)
-#define META_BLOCKS_PER_SLAB (METADATA_BYTES_PER_BLOCK * BLOCKS_PER_SLAB / BLOCK_SIZE)
 #define NONMETA_BLOCKS_PER_SLAB (BLOCKS_PER_SLAB - META_BLOCKS_PER_SLAB)
 #define METADATA_BYTES_PER_SLAB (NONMETA_BLOCKS_PER_SLAB * METADATA_BYTES_PER_BLOCK)
 #define SLACK_METADATA_BYTES_PER_SLAB (META_BLOCKS_PER_SLAB * METADATA_BYTES_PER_BLOCK)
@@ -96,6 +142,13 @@ static uint8_t rotate_dead_survivor_marked(uint8_t mask) {
 #define SLACK_SUMMARY_BYTES_PER_SLAB (SUMMARY_BYTES_PER_BLOCK * META_BLOCKS_PER_SLAB)
 #define HEADER_BYTES_PER_SLAB SLACK_SUMMARY_BYTES_PER_SLAB
 
+// The metadata blocks cover at least the metadata bytes of the whole
+// slab; any remainder is padding.
+#define PADDING_BYTES_PER_SLAB \
+  (META_BLOCKS_PER_SLAB * BLOCK_SIZE - METADATA_BYTES_PER_BLOCK * BLOCKS_PER_SLAB)
+STATIC_ASSERT_EQ(META_BLOCKS_PER_SLAB * BLOCK_SIZE
+                 >= METADATA_BYTES_PER_BLOCK * BLOCKS_PER_SLAB, 1);
+
 struct slab;
 
 struct slab_header {
@@ -115,6 +168,30 @@ STATIC_ASSERT_EQ(sizeof(struct slab_header), HEADER_BYTES_PER_SLAB);
 // hide up to 15 flags in the low bits.  These flags can be accessed
 // non-atomically by the mutator when it owns a block; otherwise they
 // need to be accessed atomically.
+//
+// BLOCK_ZERO indicates that the block's memory is known to be all
+// zeroes: either it is fresh from mmap, or it was last returned to the
+// OS with madvise.  Such blocks don't need to be cleared before
+// allocating into them.  Whoever first writes to the block clears the
+// flag.
+//
+// BLOCK_SWEPT indicates that a background sweeper has already swept the
+// block: its holes have cleared metadata and memory, and its summary
+// counts holes and free granules.  The mutator that allocates into the
+// block clears the flag when it is done with the block.
+//
+// BLOCK_OUT_FOR_THREAD indicates that a mutator took the block from
+// the empties list during the current allocation cycle.  The block
+// needs sweeping after the next collection, but not before: its objects
+// are all young, and would look dead to a sweeper.  Sweep runs claimed
+// from the cursor may lag behind the empties list, so sweepers check
+// for this flag as well as BLOCK_NEEDS_SWEEP.  It is cleared when the
+// sweep cursor is reset after collection.
+//
+// BLOCK_PAGED_OUT indicates that an unavailable block's memory has
+// been returned to the OS.  Unavailable blocks are queued and returned
+// in batches, so for a while an unavailable block may still be paged
+// in.
 enum block_summary_flag {
   BLOCK_OUT_FOR_THREAD = 0x1,
   BLOCK_HAS_PIN = 0x2,
@@ -122,8 +199,8 @@ enum block_summary_flag {
   BLOCK_NEEDS_SWEEP = 0x8,
   BLOCK_UNAVAILABLE = 0x10,
   BLOCK_EVACUATE = 0x20,
-  BLOCK_FLAG_UNUSED_6 = 0x40,
-  BLOCK_FLAG_UNUSED_7 = 0x80,
+  BLOCK_ZERO = 0x40,
+  BLOCK_SWEPT = 0x80,
   BLOCK_FLAG_UNUSED_8 = 0x100,
   BLOCK_FLAG_UNUSED_9 = 0x200,
   BLOCK_FLAG_UNUSED_10 = 0x400,
@@ -166,6 +243,7 @@ struct slab {
   struct block_summary summaries[NONMETA_BLOCKS_PER_SLAB];
   uint8_t remsets[REMSET_BYTES_PER_SLAB];
   uint8_t metadata[METADATA_BYTES_PER_SLAB];
+  uint8_t padding[PADDING_BYTES_PER_SLAB];
   struct block blocks[NONMETA_BLOCKS_PER_SLAB];
 };
 STATIC_ASSERT_EQ(sizeof(struct slab), SLAB_SIZE);
@@ -221,34 +299,85 @@ static void block_summary_set_next(struct block_summary *summary,
     (summary->next_and_flags & (BLOCK_SIZE - 1)) | next;
 }
 
-// Lock-free block list.
+// Lock-free block list.  A pop reads the head A and its successor B,
+// then swings the head from A to B.  Between the two, other threads
+// could pop A and B and push A back, and the pop would then install B
+// although another thread owns it; pop_blocks walks several links first,
+// widening that window.  So the head word carries a tag in the low bits
+// that block alignment leaves free, and every pop increments it: a pop's
+// CAS fails if any other pop intervened, unless the tag wrapped all the
+// way around, which takes BLOCK_SIZE pops.  Pushes keep the tag, as they
+// only add blocks above the head, leaving the walked chain intact.
 struct block_list {
   size_t count;
   uintptr_t blocks;
 };
 
+#define BLOCK_LIST_TAG_MASK ((uintptr_t)BLOCK_SIZE - 1)
+
+static uintptr_t block_list_word_head(uintptr_t word) {
+  return word & ~BLOCK_LIST_TAG_MASK;
+}
+
+static uintptr_t block_list_first(struct block_list *list) {
+  return block_list_word_head(atomic_load_explicit(&list->blocks,
+                                                   memory_order_acquire));
+}
+
+// Push the chain from FIRST to LAST, already linked, onto LIST.
+static void push_block_chain(struct block_list *list, uintptr_t first,
+                             uintptr_t last) {
+  struct block_summary *summary = block_summary_for_addr(last);
+  uintptr_t word = atomic_load_explicit(&list->blocks, memory_order_acquire);
+  do {
+    block_summary_set_next(summary, block_list_word_head(word));
+  } while (!atomic_compare_exchange_weak(&list->blocks, &word,
+                                         first | (word & BLOCK_LIST_TAG_MASK)));
+}
+
 static void push_block(struct block_list *list, uintptr_t block) {
   atomic_fetch_add_explicit(&list->count, 1, memory_order_acq_rel);
-  struct block_summary *summary = block_summary_for_addr(block);
-  uintptr_t next = atomic_load_explicit(&list->blocks, memory_order_acquire);
-  do {
-    block_summary_set_next(summary, next);
-  } while (!atomic_compare_exchange_weak(&list->blocks, &next, block));
+  push_block_chain(list, block, block);
 }
 
-static uintptr_t pop_block(struct block_list *list) {
-  uintptr_t head = atomic_load_explicit(&list->blocks, memory_order_acquire);
-  struct block_summary *summary;
+// Pop up to N blocks from LIST into BLOCKS with a single CAS, returning
+// the number of blocks popped.
+static size_t pop_blocks(struct block_list *list, uintptr_t *blocks,
+                         size_t n) {
+  uintptr_t word = atomic_load_explicit(&list->blocks, memory_order_acquire);
   uintptr_t next;
+  size_t count;
   do {
-    if (!head)
+    next = block_list_word_head(word);
+    if (!next)
       return 0;
-    summary = block_summary_for_addr(head);
-    next = block_summary_next(summary);
-  } while (!atomic_compare_exchange_weak(&list->blocks, &head, next));
-  block_summary_set_next(summary, 0);
-  atomic_fetch_sub_explicit(&list->count, 1, memory_order_acq_rel);
-  return head;
+    for (count = 0; count < n && next; count++) {
+      blocks[count] = next;
+      next = block_summary_next(block_summary_for_addr(next));
+    }
+  } while (!atomic_compare_exchange_weak(&list->blocks, &word,
+                                         next | ((word + 1)
+                                                 & BLOCK_LIST_TAG_MASK)));
+  for (size_t i = 0; i < count; i++)
+    block_summary_set_next(block_summary_for_addr(blocks[i]), 0);
+  atomic_fetch_sub_explicit(&list->count, count, memory_order_acq_rel);
+  return count;
+}
+
+static uintptr_t pop_block(struct block_list *list) {
+  uintptr_t block;
+  return pop_blocks(list, &block, 1) ? block : 0;
+}
+
+// Push N blocks onto LIST with a single CAS.
+static void push_blocks(struct block_list *list, uintptr_t *blocks,
+                        size_t n) {
+  if (!n)
+    return;
+  atomic_fetch_add_explicit(&list->count, n, memory_order_acq_rel);
+  for (size_t i = 0; i + 1 < n; i++)
+    block_summary_set_next(block_summary_for_addr(blocks[i]), blocks[i + 1]);
+  push_block_chain(list, blocks[0], blocks[n - 1]);
 }
 
 static uintptr_t align_up(uintptr_t addr, size_t align) {
@@ -259,16 +388,23 @@ static inline size_t size_to_granules(size_t size) {
   return (size + GRANULE_SIZE - 1) >> GRANULE_SIZE_LOG_2;
 }
 
-// Alloc kind is in bits 1-7, for live objects.
+// Alloc kind is in bits 1-7, for live objects.  Bit 8 is set for
+// objects that have no fields to trace; it is only consulted for large
+// objects, which have no metadata byte.
 static const uintptr_t gcobj_alloc_kind_mask = 0x7f;
 static const uintptr_t gcobj_alloc_kind_shift = 1;
 static const uintptr_t gcobj_forwarded_mask = 0x1;
 static const uintptr_t gcobj_not_forwarded_bit = 0x1;
+static const uintptr_t gcobj_pointerless_bit = 0x100;
 static inline uint8_t tag_live_alloc_kind(uintptr_t tag) {
   return (tag >> gcobj_alloc_kind_shift) & gcobj_alloc_kind_mask;
 }
-static inline uintptr_t tag_live(uint8_t alloc_kind) {
+static inline int tag_live_is_pointerless(uintptr_t tag) {
+  return (tag & gcobj_pointerless_bit) != 0;
+}
+static inline uintptr_t tag_live(uint8_t alloc_kind, int pointerless) {
   return ((uintptr_t)alloc_kind << gcobj_alloc_kind_shift)
+    | (pointerless ? gcobj_pointerless_bit : 0)
     | gcobj_not_forwarded_bit;
 }
 static inline uintptr_t tag_forwarded(struct gcobj *new_addr) {
@@ -288,6 +424,13 @@ struct evacuation_allocator {
   uintptr_t block_cursor; // atomically
 };
 
+// Optional NUMA support.  With GC_NUMA=1 on a machine with more than
+// one node, slab I prefers to get its memory from node I % N, and each
+// node has its own sweep cursor and its own lists of empty and swept
+// blocks.  Mutators and sweepers prefer blocks on their own node.
+// Otherwise there is a single node.
+#define NUMA_MAX_NODES 16
+
 struct mark_space {
   uint64_t sweep_mask;
   uint8_t live_mask;
@@ -296,17 +439,27 @@ struct mark_space {
   uintptr_t low_addr;
   size_t extent;
   size_t heap_size;
-  uintptr_t next_block;   // atomically
-  struct block_list empty;
+  size_t numa_nodes;
+  uintptr_t next_block[NUMA_MAX_NODES];   // atomically
+  struct block_list empty[NUMA_MAX_NODES];
   struct block_list unavailable;
   struct block_list evacuation_targets;
+  struct block_list swept[NUMA_MAX_NODES];
+  struct block_list deferred;
+  struct block_list decommit;
+  uint64_t fresh_blocks; // atomically
   double evacuation_reserve;
   ssize_t pending_unavailable_bytes; // atomically
   struct evacuation_allocator evacuation_allocator;
   struct slab *slabs;
   size_t nslabs;
+  size_t reserved_nslabs;
+  int huge_pages;
+  int decommit_advice;
+  pthread_mutex_t decommit_lock;
   uintptr_t granules_freed_by_last_collection; // atomically
   uintptr_t fragmentation_granules_since_last_collection; // atomically
+  uintptr_t deferred_blocks_since_last_collection; // atomically
 };
 
 enum gc_kind {
@@ -314,6 +467,32 @@ enum gc_kind {
   GC_KIND_COMPACT
 };
 
+// Optional background sweeper threads.  After a collection, sweepers
+// claim blocks from the same cursor as mutators and sweep them ahead of
+// time.  Sweepers are paused before marking, as they write metadata.
+struct sweepers {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t idle_cond;
+  size_t count;
+  size_t active;
+  long epoch;
+  int paused; // atomically
+};
+
+struct mutator;
+
+// Contention on the sweep cursor, for mutators or for background
+// sweepers: runs claimed and CAS retries, added up as threads finish
+// sweeping, and the most of each by any one thread so far.
+struct sweep_statistics {
+  size_t claims; // atomically
+  size_t retries; // atomically
+  size_t max_thread_claims; // atomically
+  size_t max_thread_retries; // atomically
+  size_t threads; // atomically
+};
+
 struct heap {
   struct mark_space mark_space;
   struct large_object_space large_object_space;
@@ -322,16 +501,33 @@ struct heap {
   pthread_cond_t collector_cond;
   pthread_cond_t mutator_cond;
   size_t size;
+  size_t maximum_size;
+  int adaptive_sizing;
+  // Inputs for adaptive heap sizing: smoothed allocation rate and
+  // collection speed, in bytes per microsecond.
+  double allocation_rate;
+  double gc_speed;
+  uint64_t last_gc_end_usec;
+  uint64_t last_gc_usec;
+  size_t peak_size;
+  size_t grow_count;
+  size_t shrink_count;
+  size_t emergency_collection_count;
+  struct sweep_statistics mutator_sweep_statistics;
+  struct sweep_statistics sweeper_sweep_statistics;
+  int (*out_of_memory_handler)(struct mutator *mut, size_t bytes);
   int collecting;
   enum gc_kind gc_kind;
   int multithreaded;
   size_t active_mutator_count;
+  size_t paused_mutator_count;
   size_t mutator_count;
   struct handle *global_roots;
   struct mutator *mutator_trace_list;
   long count;
   struct mutator *deactivated_mutators;
   struct tracer tracer;
+  struct sweepers sweepers;
   double fragmentation_low_threshold;
   double fragmentation_high_threshold;
 };
@@ -342,11 +538,50 @@ struct mutator_mark_buf {
   struct gcobj **objects;
 };
 
+// Each mutator caches a few empty blocks, taking them from and
+// returning them to the global empties list in batches, so that
+// mutators don't contend on the list head for every block.
+#define BLOCK_MAGAZINE_SIZE 16
+#define BLOCK_MAGAZINE_BATCH 8
+
+struct block_magazine {
+  size_t count;
+  uintptr_t blocks[BLOCK_MAGAZINE_SIZE];
+};
+
+// Sweeping claims runs of consecutive blocks from the global sweep
+// cursor with a single CAS, then walks them locally.  A run never
+// spans a slab boundary.
+#define SWEEP_RUN_BLOCKS 8
+
+struct sweep_run {
+  uintptr_t next;
+  uintptr_t limit;
+  // Statistics, to measure contention on the global cursor: runs
+  // claimed and CAS retries since they were last flushed, and in total
+  // for this thread.
+  size_t claims;
+  size_t retries;
+  size_t thread_claims;
+  size_t thread_retries;
+};
+
 struct mutator {
   // Bump-pointer allocation into holes.
   uintptr_t alloc;
   uintptr_t sweep;
   uintptr_t block;
+  // Bump-pointer allocation into empty blocks, for medium objects that
+  // don't fit in the current hole.
+  uintptr_t overflow_alloc;
+  uintptr_t overflow_sweep;
+  uintptr_t overflow_block;
+  // Memory below these is cleared; see clear_for_allocation.
+  uintptr_t clear;
+  uintptr_t overflow_clear;
+  struct block_magazine empties;
+  struct sweep_run sweep_run;
+  size_t numa_node;
   struct heap *heap;
   struct handle *roots;
   struct mutator_mark_buf mark_buf;
@@ -378,7 +613,10 @@ static inline void clear_memory(uintptr_t addr, size_t size) {
 
 enum gc_reason {
   GC_REASON_SMALL_ALLOCATION,
-  GC_REASON_LARGE_ALLOCATION
+  GC_REASON_LARGE_ALLOCATION,
+  // An allocation failed even after collecting and trying to grow the
+  // heap.  As a last resort, compact the heap as much as we can.
+  GC_REASON_OUT_OF_MEMORY
 };
 
 static void collect(struct mutator *mut, enum gc_reason reason) NEVER_INLINE;
@@ -388,10 +626,16 @@ static inline uint8_t* mark_byte(struct mark_space *space, struct gcobj *obj) {
 }
 
 static size_t mark_space_live_object_granules(uint8_t *metadata) {
-  size_t n = 0;
-  while ((metadata[n] & METADATA_BYTE_END) == 0)
-    n++;
-  return n + 1;
+  // Most objects are small, so check the first byte directly before
+  // scanning for the END byte.  Objects in the mark space are never
+  // larger than LARGE_OBJECT_GRANULE_THRESHOLD granules.
+  if (metadata[0] & METADATA_BYTE_END)
+    return 1;
+  size_t n = scan_for_byte_with_bits(metadata + 1,
+                                     LARGE_OBJECT_GRANULE_THRESHOLD - 1,
+                                     broadcast_byte(METADATA_BYTE_END));
+  ASSERT(n < LARGE_OBJECT_GRANULE_THRESHOLD - 1);
+  return n + 2;
 }
 
 static inline int mark_space_mark_object(struct mark_space *space,
@@ -404,7 +648,8 @@ static inline int mark_space_mark_object(struct mark_space *space,
   uint8_t mask = METADATA_BYTE_YOUNG | METADATA_BYTE_MARK_0
     | METADATA_BYTE_MARK_1 | METADATA_BYTE_MARK_2;
   *loc = (byte & ~mask) | space->marked_mask;
-  return 1;
+  // Pointerless objects are marked but have no fields to trace.
+  return (byte & METADATA_BYTE_POINTERLESS) == 0;
 }
 
 static uintptr_t make_evacuation_allocator_cursor(uintptr_t block,
@@ -415,16 +660,18 @@ static uintptr_t make_evacuation_allocator_cursor(uintptr_t block,
 
 static void prepare_evacuation_allocator(struct evacuation_allocator *alloc,
                                          struct block_list *targets) {
-  uintptr_t first_block = targets->blocks;
+  uintptr_t first_block = block_list_first(targets);
   atomic_store_explicit(&alloc->allocated, 0, memory_order_release);
   atomic_store_explicit(&alloc->block_cursor,
                         make_evacuation_allocator_cursor(first_block, 0),
                         memory_order_release);
 }
 
+static void push_empty_block(struct mark_space *space, uintptr_t block);
+
 static void finish_evacuation_allocator(struct evacuation_allocator *alloc,
                                         struct block_list *targets,
-                                        struct block_list *empties) {
+                                        struct mark_space *space) {
   // Blocks that we used for evacuation get returned to the mutator as
   // sweepable blocks.  Blocks that we didn't get to use go to the
   // empties.
@@ -432,8 +679,9 @@ static void finish_evacuation_allocator(struct evacuation_allocator *alloc,
     uintptr_t block = pop_block(targets);
     if (!block)
       break;
-    block_summary_set_flag(block_summary_for_addr(block),
-                           BLOCK_NEEDS_SWEEP);
+    struct block_summary *summary = block_summary_for_addr(block);
+    block_summary_set_flag(summary, BLOCK_NEEDS_SWEEP);
+    block_summary_clear_flag(summary, BLOCK_ZERO);
     if (alloc->allocated <= BLOCK_SIZE)
       break;
     alloc->allocated -= BLOCK_SIZE;
@@ -442,7 +690,7 @@ static void finish_evacuation_allocator(struct evacuation_allocator *alloc,
     uintptr_t block = pop_block(targets);
     if (!block)
       break;
-    push_block(empties, block);
+    push_empty_block(space, block);
   }
 }
 
@@ -580,7 +828,7 @@ static inline int mark_space_evacuate_or_mark_object(struct mark_space *space,
   uint8_t mask = METADATA_BYTE_YOUNG | METADATA_BYTE_MARK_0
     | METADATA_BYTE_MARK_1 | METADATA_BYTE_MARK_2;
   *metadata = (byte & ~mask) | space->marked_mask;
-  return 1;
+  return (byte & METADATA_BYTE_POINTERLESS) == 0;
 }
 
 static inline int mark_space_contains(struct mark_space *space,
@@ -591,7 +839,9 @@ static inline int mark_space_contains(struct mark_space *space,
 
 static inline int large_object_space_mark_object(struct large_object_space *space,
                                                  struct gcobj *obj) {
-  return large_object_space_copy(space, (uintptr_t)obj);
+  if (!large_object_space_copy(space, (uintptr_t)obj))
+    return 0;
+  return !tag_live_is_pointerless(obj->tag);
 }
 
 static inline int trace_edge(struct heap *heap, struct gc_edge edge) {
@@ -649,6 +899,7 @@ static void add_mutator(struct heap *heap, struct mutator *mut) {
     heap->multithreaded = 1;
   heap->active_mutator_count++;
   heap->mutator_count++;
+  atomic_fetch_add(&heap->mutator_sweep_statistics.threads, 1);
   heap_unlock(heap);
 }
 
@@ -672,39 +923,392 @@ static void request_mutators_to_stop(struct heap *heap) {
 static void allow_mutators_to_continue(struct heap *heap) {
   ASSERT(mutators_are_stopping(heap));
   ASSERT(heap->active_mutator_count == 0);
-  heap->active_mutator_count++;
+  // Paused mutators count as active again from now on, not from when
+  // they get around to waking up: if this thread collects again before
+  // they do, it has to wait for them to stop again and mark their
+  // roots.
+  heap->active_mutator_count += 1 + heap->paused_mutator_count;
+  heap->paused_mutator_count = 0;
   atomic_store_explicit(&heap->collecting, 0, memory_order_relaxed);
   ASSERT(!mutators_are_stopping(heap));
   pthread_cond_broadcast(&heap->mutator_cond);
 }
 
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static size_t count_numa_nodes(void) {
+#if defined(SYS_mbind) && defined(SYS_getcpu)
+  // The file holds a list of node ranges, like "0-1" or "0,2-3"; we
+  // assume that nodes are numbered densely.
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+  if (!f)
+    return 1;
+  char buf[256];
+  size_t nodes = 1;
+  if (fgets(buf, sizeof(buf), f)) {
+    for (char *p = buf; *p;) {
+      if (*p >= '0' && *p <= '9') {
+        size_t node = strtoul(p, &p, 10);
+        if (node + 1 > nodes)
+          nodes = node + 1;
+      } else {
+        p++;
+      }
+    }
+  }
+  fclose(f);
+  return nodes <= NUMA_MAX_NODES ? nodes : 1;
+#else
+  return 1;
+#endif
+}
+
+static size_t slab_numa_node(struct mark_space *space, size_t slab) {
+  return slab % space->numa_nodes;
+}
+
+static size_t block_numa_node(struct mark_space *space, uintptr_t block) {
+  return slab_numa_node(space, (block - space->low_addr) / SLAB_SIZE);
+}
+
+static size_t current_numa_node(struct mark_space *space) {
+  if (space->numa_nodes == 1)
+    return 0;
+#ifdef SYS_getcpu
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < space->numa_nodes)
+    return node;
+#endif
+  return 0;
+}
+
+static int bind_slab_to_numa_node(struct mark_space *space, size_t slab) {
+  if (space->numa_nodes == 1)
+    return 1;
+#ifdef SYS_mbind
+  unsigned long mask = 1UL << slab_numa_node(space, slab);
+  // The kernel only looks at the first MAXNODE - 1 bits of the mask.
+  return syscall(SYS_mbind, &space->slabs[slab], SLAB_SIZE, MPOL_PREFERRED,
+                 &mask, sizeof(mask) * 8 + 1, 0) == 0;
+#else
+  return 0;
+#endif
+}
+
+// Returning unavailable blocks to the OS one madvise at a time is
+// costly, and it happens on the large-allocation path.  Instead,
+// push_unavailable_block queues the block, and once enough blocks are
+// queued, they are sorted and returned with one madvise per contiguous
+// run.  A queued block that is reacquired before it is returned costs
+// no syscall at all.
+#define DECOMMIT_BATCH_BLOCKS 64
+
+// When slabs are backed by transparent huge pages, returning a single
+// block to the OS would shatter its huge page.  Instead we only return
+// whole 2 MB huge pages, once all of their blocks are unavailable.  The
+// first huge page of each slab also holds the slab's metadata, which
+// stays in use; once its data blocks are all unavailable, we return just
+// those, splitting that one huge page per slab.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define BLOCKS_PER_HUGE_PAGE (HUGE_PAGE_SIZE / BLOCK_SIZE)
+
+// Blocks are only put on the block lists once they are first used.
+// Blocks above a high-water mark are fresh: their summaries and memory
+// are still zero from mmap.  Some of the fresh blocks count as empty;
+// the rest are unavailable.  The high-water mark and the number of
+// fresh empty blocks are packed into one word, so that both can be
+// updated together.  Block indices skip slab metadata blocks.
+#define FRESH_BLOCKS_CLAIMED_SHIFT 32
+#define FRESH_EMPTY_BLOCKS_MASK ((1ULL << FRESH_BLOCKS_CLAIMED_SHIFT) - 1)
+
+static size_t fresh_blocks_claimed(uint64_t fresh) {
+  return fresh >> FRESH_BLOCKS_CLAIMED_SHIFT;
+}
+static size_t fresh_empty_blocks(uint64_t fresh) {
+  return fresh & FRESH_EMPTY_BLOCKS_MASK;
+}
+
+static uintptr_t mark_space_block_at_index(struct mark_space *space,
+                                           size_t index) {
+  struct slab *slab = &space->slabs[index / NONMETA_BLOCKS_PER_SLAB];
+  return (uintptr_t)slab->blocks[index % NONMETA_BLOCKS_PER_SLAB].data;
+}
+
+static size_t mark_space_fresh_block_count(struct mark_space *space,
+                                           uint64_t fresh) {
+  return space->nslabs * NONMETA_BLOCKS_PER_SLAB - fresh_blocks_claimed(fresh);
+}
+
+// Claim up to N fresh empty blocks, returning the number claimed.
+static size_t claim_fresh_blocks(struct mark_space *space, uintptr_t *blocks,
+                                 size_t n) {
+  uint64_t fresh = atomic_load_explicit(&space->fresh_blocks,
+                                        memory_order_acquire);
+  do {
+    if (!fresh_empty_blocks(fresh))
+      return 0;
+    if (n > fresh_empty_blocks(fresh))
+      n = fresh_empty_blocks(fresh);
+  } while (!atomic_compare_exchange_weak(&space->fresh_blocks, &fresh,
+                                         fresh - n +
+                                         (n << FRESH_BLOCKS_CLAIMED_SHIFT)));
+  size_t index = fresh_blocks_claimed(fresh);
+  for (size_t i = 0; i < n; i++) {
+    uintptr_t block = mark_space_block_at_index(space, index + i);
+    // Fresh blocks are entirely free, which matters if they are chosen
+    // as evacuation targets.
+    struct block_summary *summary = block_summary_for_addr(block);
+    summary->hole_count = 1;
+    summary->free_granules = GRANULES_PER_BLOCK;
+    block_summary_set_flag(summary, BLOCK_ZERO);
+    blocks[i] = block;
+  }
+  return n;
+}
+
+// Make up to N fresh empty blocks unavailable, returning how many.
+static size_t release_fresh_blocks(struct mark_space *space, size_t n) {
+  uint64_t fresh = atomic_load_explicit(&space->fresh_blocks,
+                                        memory_order_acquire);
+  do {
+    if (!fresh_empty_blocks(fresh))
+      return 0;
+    if (n > fresh_empty_blocks(fresh))
+      n = fresh_empty_blocks(fresh);
+  } while (!atomic_compare_exchange_weak(&space->fresh_blocks, &fresh,
+                                         fresh - n));
+  return n;
+}
+
+// Make an unavailable fresh block empty, if there is one.
+static int reacquire_fresh_block(struct mark_space *space) {
+  uint64_t fresh = atomic_load_explicit(&space->fresh_blocks,
+                                        memory_order_acquire);
+  do {
+    if (fresh_empty_blocks(fresh) == mark_space_fresh_block_count(space, fresh))
+      return 0;
+  } while (!atomic_compare_exchange_weak(&space->fresh_blocks, &fresh,
+                                         fresh + 1));
+  return 1;
+}
+
+static size_t mark_space_fresh_unavailable_block_count(struct mark_space *space) {
+  uint64_t fresh = atomic_load_explicit(&space->fresh_blocks,
+                                        memory_order_acquire);
+  return mark_space_fresh_block_count(space, fresh) - fresh_empty_blocks(fresh);
+}
+
+static size_t mark_space_unavailable_block_count(struct mark_space *space) {
+  return atomic_load_explicit(&space->unavailable.count, memory_order_acquire)
+    + atomic_load_explicit(&space->decommit.count, memory_order_acquire)
+    + mark_space_fresh_unavailable_block_count(space);
+}
+
+static uintptr_t huge_page_first_data_block(uintptr_t base) {
+  if ((base & (SLAB_SIZE - 1)) == 0)
+    return base + META_BLOCKS_PER_SLAB * BLOCK_SIZE;
+  return base;
+}
+
+static int huge_page_is_unavailable(uintptr_t base) {
+  uintptr_t end = base + HUGE_PAGE_SIZE;
+  for (uintptr_t block = huge_page_first_data_block(base);
+       block < end;
+       block += BLOCK_SIZE) {
+    struct block_summary *summary = block_summary_for_addr(block);
+    if (!block_summary_has_flag(summary, BLOCK_UNAVAILABLE))
+      return 0;
+  }
+  return 1;
+}
+
+static void decommit_run(struct mark_space *space, uintptr_t start,
+                         uintptr_t end) {
+  if (madvise((void*)start, end - start, space->decommit_advice)) {
+    if (space->decommit_advice == MADV_DONTNEED)
+      return;
+    // MADV_FREE needs Linux 4.5.
+    space->decommit_advice = MADV_DONTNEED;
+    if (madvise((void*)start, end - start, MADV_DONTNEED))
+      return;
+  }
+  // Pages released with MADV_FREE keep their contents until the kernel
+  // reclaims them, so they are not known to be zero.
+  enum block_summary_flag flags = BLOCK_PAGED_OUT;
+  if (space->decommit_advice == MADV_DONTNEED)
+    flags |= BLOCK_ZERO;
+  for (uintptr_t block = start; block < end; block += BLOCK_SIZE)
+    block_summary_set_flag(block_summary_for_addr(block), flags);
+}
+
+static void sort_blocks(uintptr_t *blocks, size_t n) {
+  for (size_t i = 1; i < n; i++) {
+    uintptr_t block = blocks[i];
+    size_t j = i;
+    for (; j && blocks[j - 1] > block; j--)
+      blocks[j] = blocks[j - 1];
+    blocks[j] = block;
+  }
+}
+
+// Return queued unavailable blocks to the OS.  May be called by any
+// thread.
+static void mark_space_decommit_queued_blocks(struct mark_space *space) {
+  if (!atomic_load_explicit(&space->decommit.count, memory_order_acquire))
+    return;
+  pthread_mutex_lock(&space->decommit_lock);
+  uintptr_t blocks[DECOMMIT_BATCH_BLOCKS];
+  size_t n;
+  while ((n = pop_blocks(&space->decommit, blocks, DECOMMIT_BATCH_BLOCKS))) {
+    sort_blocks(blocks, n);
+    uintptr_t start = 0, end = 0;
+    for (size_t i = 0; i < n; i++) {
+      uintptr_t lo = blocks[i], hi = blocks[i] + BLOCK_SIZE;
+      if (space->huge_pages) {
+        uintptr_t page = blocks[i] & ~(HUGE_PAGE_SIZE - 1);
+        lo = huge_page_first_data_block(page);
+        hi = page + HUGE_PAGE_SIZE;
+        if (lo < end || !huge_page_is_unavailable(page))
+          continue;
+      }
+      if (lo != end) {
+        if (start != end)
+          decommit_run(space, start, end);
+        start = lo;
+      }
+      end = hi;
+    }
+    if (start != end)
+      decommit_run(space, start, end);
+    push_blocks(&space->unavailable, blocks, n);
+  }
+  pthread_mutex_unlock(&space->decommit_lock);
+}
+
 static void push_unavailable_block(struct mark_space *space, uintptr_t block) {
   struct block_summary *summary = block_summary_for_addr(block);
   ASSERT(!block_summary_has_flag(summary, BLOCK_NEEDS_SWEEP));
   ASSERT(!block_summary_has_flag(summary, BLOCK_UNAVAILABLE));
+  // In huge-page mode, the lock keeps us from racing with a release of
+  // the block's huge page, which updates the flags of all its blocks.
+  if (space->huge_pages)
+    pthread_mutex_lock(&space->decommit_lock);
   block_summary_set_flag(summary, BLOCK_UNAVAILABLE);
-  madvise((void*)block, BLOCK_SIZE, MADV_DONTNEED);
-  push_block(&space->unavailable, block);
+  push_block(&space->decommit, block);
+  if (space->huge_pages)
+    pthread_mutex_unlock(&space->decommit_lock);
+  if (atomic_load_explicit(&space->decommit.count, memory_order_relaxed)
+      >= DECOMMIT_BATCH_BLOCKS)
+    mark_space_decommit_queued_blocks(space);
 }
 
-static uintptr_t pop_unavailable_block(struct mark_space *space) {
-  uintptr_t block = pop_block(&space->unavailable);
+static uintptr_t try_pop_unavailable_block(struct mark_space *space) {
+  // Prefer queued blocks, whose memory is still paged in.
+  uintptr_t block = pop_block(&space->decommit);
   if (!block)
-    return 0;
-  struct block_summary *summary = block_summary_for_addr(block);
-  ASSERT(block_summary_has_flag(summary, BLOCK_UNAVAILABLE));
-  block_summary_clear_flag(summary, BLOCK_UNAVAILABLE);
+    block = pop_block(&space->unavailable);
+  if (block) {
+    struct block_summary *summary = block_summary_for_addr(block);
+    ASSERT(block_summary_has_flag(summary, BLOCK_UNAVAILABLE));
+    block_summary_clear_flag(summary, BLOCK_UNAVAILABLE | BLOCK_PAGED_OUT);
+  }
+  return block;
+}
+
+static uintptr_t pop_unavailable_block(struct mark_space *space) {
+  uintptr_t block = 0;
+  // In huge-page mode, the lock prevents us from taking a block out of
+  // a huge page that is being released.
+  if (!space->huge_pages)
+    block = try_pop_unavailable_block(space);
+  if (!block) {
+    // Otherwise perhaps the blocks are being decommitted; wait for them.
+    pthread_mutex_lock(&space->decommit_lock);
+    block = try_pop_unavailable_block(space);
+    pthread_mutex_unlock(&space->decommit_lock);
+  }
   return block;
 }
 
 static uintptr_t pop_empty_block(struct mark_space *space) {
-  return pop_block(&space->empty);
+  uintptr_t block = 0;
+  for (size_t node = 0; node < space->numa_nodes && !block; node++)
+    block = pop_block(&space->empty[node]);
+  if (!block)
+    claim_fresh_blocks(space, &block, 1);
+  return block;
 }
 
 static void push_empty_block(struct mark_space *space, uintptr_t block) {
   ASSERT(!block_summary_has_flag(block_summary_for_addr(block),
                                  BLOCK_NEEDS_SWEEP));
-  push_block(&space->empty, block);
+  push_block(&space->empty[block_numa_node(space, block)], block);
+}
+
+static void push_empty_blocks(struct mark_space *space, uintptr_t *blocks,
+                              size_t n) {
+  if (space->numa_nodes == 1) {
+    push_blocks(&space->empty[0], blocks, n);
+    return;
+  }
+  for (size_t i = 0; i < n; i++)
+    push_empty_block(space, blocks[i]);
+}
+
+static uintptr_t pop_empty_block_for_mutator(struct mutator *mut) {
+  struct block_magazine *mag = &mut->empties;
+  if (!mag->count) {
+    // Refill the magazine.  Take at most a fair share of the remaining
+    // empties, so that one mutator doesn't hoard the last few blocks
+    // while others trigger collection for want of them.
+    struct heap *heap = mutator_heap(mut);
+    struct mark_space *space = heap_mark_space(heap);
+    size_t node = mut->numa_node = current_numa_node(space);
+    size_t empties =
+      atomic_load_explicit(&space->empty[node].count, memory_order_relaxed)
+      + fresh_empty_blocks(atomic_load_explicit(&space->fresh_blocks,
+                                                memory_order_relaxed));
+    size_t mutators = atomic_load_explicit(&heap->mutator_count,
+                                           memory_order_relaxed);
+    size_t batch = empties / (2 * (mutators ? mutators : 1));
+    if (batch > BLOCK_MAGAZINE_BATCH)
+      batch = BLOCK_MAGAZINE_BATCH;
+    if (batch < 1)
+      batch = 1;
+    // Prefer blocks on our own node.
+    for (size_t i = 0; i < space->numa_nodes && !mag->count; i++)
+      mag->count = pop_blocks(&space->empty[(node + i) % space->numa_nodes],
+                              mag->blocks, batch);
+    if (!mag->count)
+      mag->count = claim_fresh_blocks(space, mag->blocks, batch);
+    if (!mag->count)
+      return 0;
+  }
+  return mag->blocks[--mag->count];
+}
+
+static void push_empty_block_for_mutator(struct mutator *mut,
+                                         uintptr_t block) {
+  ASSERT(!block_summary_has_flag(block_summary_for_addr(block),
+                                 BLOCK_NEEDS_SWEEP));
+  struct block_magazine *mag = &mut->empties;
+  if (mag->count == BLOCK_MAGAZINE_SIZE) {
+    struct mark_space *space = heap_mark_space(mutator_heap(mut));
+    mag->count -= BLOCK_MAGAZINE_BATCH;
+    push_empty_blocks(space, mag->blocks + mag->count, BLOCK_MAGAZINE_BATCH);
+  }
+  mag->blocks[mag->count++] = block;
+}
+
+// Return all of the mutator's cached empty blocks to the global list,
+// for example before a collection, which needs to see all empties.
+static void flush_empty_blocks_for_mutator(struct mutator *mut) {
+  struct block_magazine *mag = &mut->empties;
+  struct mark_space *space = heap_mark_space(mutator_heap(mut));
+  push_empty_blocks(space, mag->blocks, mag->count);
+  mag->count = 0;
 }
 
 static int maybe_push_evacuation_target(struct mark_space *space,
@@ -712,8 +1316,7 @@ static int maybe_push_evacuation_target(struct mark_space *space,
   size_t targets = atomic_load_explicit(&space->evacuation_targets.count,
                                         memory_order_acquire);
   size_t total = space->nslabs * NONMETA_BLOCKS_PER_SLAB;
-  size_t unavailable = atomic_load_explicit(&space->unavailable.count,
-                                            memory_order_acquire);
+  size_t unavailable = mark_space_unavailable_block_count(space);
   if (targets >= (total - unavailable) * space->evacuation_reserve)
     return 0;
 
@@ -735,23 +1338,36 @@ static void mark_space_reacquire_memory(struct mark_space *space,
   ssize_t pending =
     atomic_fetch_sub(&space->pending_unavailable_bytes, bytes) - bytes;
   while (pending + BLOCK_SIZE <= 0) {
-    uintptr_t block = pop_unavailable_block(space);
-    ASSERT(block);
-    push_empty_block(space, block);
+    if (!reacquire_fresh_block(space)) {
+      uintptr_t block = pop_unavailable_block(space);
+      ASSERT(block);
+      push_empty_block(space, block);
+    }
     pending = atomic_fetch_add(&space->pending_unavailable_bytes, BLOCK_SIZE)
       + BLOCK_SIZE;
   }
 }
 
 static size_t next_hole(struct mutator *mut);
+static void finish_hole(struct mutator *mut);
 
 static int sweep_until_memory_released(struct mutator *mut) {
   struct mark_space *space = heap_mark_space(mutator_heap(mut));
   ssize_t pending = atomic_load_explicit(&space->pending_unavailable_bytes,
                                          memory_order_acquire);
-  // First try to unmap previously-identified empty blocks.  If pending
-  // > 0 and other mutators happen to identify empty blocks, they will
-  // be unmapped directly and moved to the unavailable list.
+  // First try to unmap previously-identified empty blocks, including
+  // any in this mutator's cache.  If pending > 0 and other mutators
+  // happen to identify empty blocks, they will be unmapped directly and
+  // moved to the unavailable list.
+  if (pending > 0) {
+    flush_empty_blocks_for_mutator(mut);
+    // Fresh blocks can be made unavailable without touching them.
+    size_t fresh = release_fresh_blocks(space,
+                                        align_up(pending, BLOCK_SIZE)
+                                        / BLOCK_SIZE);
+    pending = atomic_fetch_sub(&space->pending_unavailable_bytes,
+                               fresh * BLOCK_SIZE) - fresh * BLOCK_SIZE;
+  }
   while (pending > 0) {
     uintptr_t block = pop_empty_block(space);
     if (!block)
@@ -773,6 +1389,9 @@ static int sweep_until_memory_released(struct mutator *mut) {
   while (pending > 0) {
     if (!next_hole(mut))
       return 0;
+    // The hole has not been cleared; throw it away too, so that the
+    // next allocation acquires a hole properly.
+    finish_hole(mut);
     pending = atomic_load_explicit(&space->pending_unavailable_bytes,
                                    memory_order_acquire);
   }
@@ -900,6 +1519,11 @@ static void wait_for_mutators_to_stop(struct heap *heap) {
 
 static void finish_sweeping(struct mutator *mut);
 static void finish_sweeping_in_block(struct mutator *mut);
+static void pause_background_sweepers(struct heap *heap);
+static void resume_background_sweepers(struct heap *heap);
+static int wait_for_background_sweepers(struct heap *heap);
+static void finish_sweeping_deferred_blocks(struct mark_space *space);
+static void release_swept_blocks(struct mark_space *space);
 
 static void trace_mutator_roots_after_stop(struct heap *heap) {
   struct mutator *mut = atomic_load(&heap->mutator_trace_list);
@@ -916,10 +1540,13 @@ static void trace_mutator_roots_after_stop(struct heap *heap) {
   }
   atomic_store(&heap->mutator_trace_list, NULL);
 
-  for (struct mutator *mut = heap->deactivated_mutators; mut; mut = mut->next) {
-    finish_sweeping_in_block(mut);
+  for (struct mutator *mut = heap->deactivated_mutators; mut; mut = mut->next)
     trace_mutator_roots_with_lock(mut);
-  }
+}
+
+static void finish_sweeping_for_deactivated_mutators(struct heap *heap) {
+  for (struct mutator *mut = heap->deactivated_mutators; mut; mut = mut->next)
+    finish_sweeping_in_block(mut);
 }
 
 static void trace_global_roots(struct heap *heap) {
@@ -935,6 +1562,7 @@ static void pause_mutator_for_collection(struct heap *heap) {
   ASSERT(mutators_are_stopping(heap));
   ASSERT(heap->active_mutator_count);
   heap->active_mutator_count--;
+  heap->paused_mutator_count++;
   if (heap->active_mutator_count == 0)
     pthread_cond_signal(&heap->collector_cond);
 
@@ -944,13 +1572,12 @@ static void pause_mutator_for_collection(struct heap *heap) {
   // mark roots, not just sleep again.  To detect a wakeup on this
   // collection vs a future collection, we use the global GC count.
   // This is safe because the count is protected by the heap lock,
-  // which we hold.
+  // which we hold.  The collector has already counted us as active
+  // again, in allow_mutators_to_continue.
   long epoch = heap->count;
   do
     pthread_cond_wait(&heap->mutator_cond, &heap->lock);
   while (mutators_are_stopping(heap) && heap->count == epoch);
-
-  heap->active_mutator_count++;
 }
 
 static void pause_mutator_for_collection_with_lock(struct mutator *mut) NEVER_INLINE;
@@ -986,12 +1613,16 @@ static inline void maybe_pause_mutator_for_collection(struct mutator *mut) {
 }
 
 static void reset_sweeper(struct mark_space *space) {
-  space->next_block = (uintptr_t) &space->slabs[0].blocks;
-}
-
-static uint64_t broadcast_byte(uint8_t byte) {
-  uint64_t result = byte;
-  return result * 0x0101010101010101ULL;
+  // Each node's cursor starts at its first slab.
+  for (size_t node = 0; node < space->numa_nodes; node++)
+    space->next_block[node] = node < space->nslabs
+      ? (uintptr_t) &space->slabs[node].blocks : 0;
+  // Blocks taken from the empties may be swept again.
+  size_t nblocks = fresh_blocks_claimed(space->fresh_blocks);
+  for (size_t i = 0; i < nblocks; i++)
+    block_summary_clear_flag(
+      block_summary_for_addr(mark_space_block_at_index(space, i)),
+      BLOCK_OUT_FOR_THREAD);
 }
 
 static void rotate_mark_bytes(struct mark_space *space) {
@@ -1003,10 +1634,191 @@ static void rotate_mark_bytes(struct mark_space *space) {
 static void reset_statistics(struct mark_space *space) {
   space->granules_freed_by_last_collection = 0;
   space->fragmentation_granules_since_last_collection = 0;
+  space->deferred_blocks_since_last_collection = 0;
 }
 
-static int maybe_grow_heap(struct heap *heap, enum gc_reason reason) {
-  return 0;
+// The mark space reserves address space for the maximum heap size up
+// front, but only commits slabs as the heap grows.  Blocks of a new
+// slab start off as unavailable fresh blocks; growing the heap then
+// makes some of them available, just as when large objects are freed.
+static int mark_space_add_slab(struct mark_space *space) {
+  if (space->nslabs == space->reserved_nslabs)
+    return 0;
+  struct slab *slab = &space->slabs[space->nslabs];
+  if (mprotect(slab, SLAB_SIZE, PROT_READ|PROT_WRITE)) {
+    perror("committing slab failed");
+    return 0;
+  }
+  bind_slab_to_numa_node(space, space->nslabs);
+  space->nslabs++;
+  atomic_store_explicit(&space->extent, space->nslabs * SLAB_SIZE,
+                        memory_order_release);
+  return 1;
+}
+
+// Grow the heap by about BYTES, committing new slabs as needed.  Return
+// 0 if the heap is already at its maximum size.  Must be called with
+// the heap lock held.
+static int heap_grow(struct heap *heap, size_t bytes) {
+  struct mark_space *space = heap_mark_space(heap);
+  bytes = align_up(bytes, BLOCK_SIZE);
+  size_t room = (heap->maximum_size - heap->size) & ~(BLOCK_SIZE - 1);
+  if (bytes > room)
+    bytes = room;
+  // Some unavailable blocks stand in for memory used by large objects;
+  // keep enough of them back that freeing the large objects can
+  // reacquire them.
+  size_t reserved = atomic_load(&heap->large_object_pages)
+    << heap_large_object_space(heap)->page_size_log2;
+  while (mark_space_unavailable_block_count(space) * BLOCK_SIZE
+         < bytes + reserved)
+    if (!mark_space_add_slab(space))
+      break;
+  size_t unavailable = mark_space_unavailable_block_count(space) * BLOCK_SIZE;
+  if (unavailable < reserved)
+    return 0;
+  if (bytes > unavailable - reserved)
+    bytes = (unavailable - reserved) & ~(BLOCK_SIZE - 1);
+  if (!bytes)
+    return 0;
+  DEBUG("growing heap by %zu bytes\n", bytes);
+  heap->size += bytes;
+  heap->grow_count++;
+  if (heap->size > heap->peak_size)
+    heap->peak_size = heap->size;
+  mark_space_reacquire_memory(space, bytes);
+  return 1;
+}
+
+// Shrink the heap by BYTES.  Empty blocks are returned to the OS right
+// away; if there aren't enough, mutators will release more as they find
+// empty blocks while sweeping.  Must be called with the heap lock held.
+static void heap_shrink(struct heap *heap, size_t bytes) {
+  struct mark_space *space = heap_mark_space(heap);
+  bytes &= ~(BLOCK_SIZE - 1);
+  if (!bytes)
+    return;
+  DEBUG("shrinking heap by %zu bytes\n", bytes);
+  heap->size -= bytes;
+  heap->shrink_count++;
+  ssize_t pending = mark_space_request_release_memory(space, bytes);
+  size_t fresh = release_fresh_blocks(space,
+                                      align_up(pending, BLOCK_SIZE) / BLOCK_SIZE);
+  pending = atomic_fetch_sub(&space->pending_unavailable_bytes,
+                             fresh * BLOCK_SIZE) - fresh * BLOCK_SIZE;
+  while (pending > 0) {
+    uintptr_t block = pop_empty_block(space);
+    if (!block)
+      break;
+    push_unavailable_block(space, block);
+    pending = atomic_fetch_sub(&space->pending_unavailable_bytes, BLOCK_SIZE)
+      - BLOCK_SIZE;
+  }
+  mark_space_decommit_queued_blocks(space);
+}
+
+static uint64_t current_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static double heap_last_gc_yield(struct heap *heap);
+
+// Adaptive heap sizing, after MemBalancer (Kirisame et al., 2022).  The
+// heap should have room for the live data L plus some extra space E,
+// where E = sqrt(L * g / (c * s)), for allocation rate g, collection
+// speed s, and a tuning constant c.  Allocating quickly or collecting
+// slowly calls for a bigger heap, so that we collect less often; a
+// mutator that allocates slowly, perhaps because it is mostly idle,
+// gets a heap closer to the size of its live data.  Here 1/c is
+// expressed in bytes.  We measure L from the yield of the last
+// collection, so we resize once its sweeping is complete, when the next
+// collection starts.
+#define HEAP_SIZE_TUNING_BYTES (256 * 1024 * 1024)
+
+static void resize_heap_adaptively(struct heap *heap) {
+  if (heap->count == 0)
+    return;
+
+  uint64_t now = current_usec();
+  double yield = heap_last_gc_yield(heap);
+  if (yield > 1)
+    yield = 1;
+  double live = heap->size * (1 - yield);
+  double allocated = heap->size * yield;
+  double mutator_usec = now - heap->last_gc_end_usec;
+  double gc_usec = heap->last_gc_usec;
+  double allocation_rate = allocated / (mutator_usec ? mutator_usec : 1);
+  double gc_speed = live / (gc_usec ? gc_usec : 1);
+  // Smooth the rates, as single cycles can be noisy.
+  if (heap->allocation_rate) {
+    allocation_rate = (heap->allocation_rate + allocation_rate) / 2;
+    gc_speed = (heap->gc_speed + gc_speed) / 2;
+  }
+  heap->allocation_rate = allocation_rate;
+  heap->gc_speed = gc_speed;
+
+  double extra_bytes =
+    sqrt(live * HEAP_SIZE_TUNING_BYTES * allocation_rate / gc_speed);
+  size_t extra =
+    extra_bytes < (double)(SIZE_MAX / 2) ? extra_bytes : SIZE_MAX / 2;
+  if (extra < SLAB_SIZE)
+    extra = SLAB_SIZE;
+  size_t target = align_up((size_t)live, BLOCK_SIZE) + align_up(extra, BLOCK_SIZE);
+  if (target > heap->maximum_size)
+    target = heap->maximum_size;
+  DEBUG("live %.0f, allocation rate %.1f B/us, gc speed %.1f B/us: target %zu\n",
+        live, allocation_rate, gc_speed, target);
+
+  // Leave some slack, so as not to resize for every small change.
+  size_t slack = heap->size / 16;
+  if (target > heap->size + slack)
+    heap_grow(heap, target - heap->size);
+  else if (target + slack < heap->size)
+    heap_shrink(heap, heap->size - target);
+}
+
+// Size the heap from the yield of the last collection.  Sweeping is
+// lazy, so the yield is only known once all of the last cycle's blocks
+// have been swept and accounted, which is after the mutators have
+// stopped for the next collection.  The new size then takes effect for
+// the cycle after this collection.  Must be called with the heap lock
+// held.
+static void maybe_resize_heap(struct heap *heap, enum gc_reason reason) {
+  // An emergency collection only happens after growing failed.
+  if (reason == GC_REASON_OUT_OF_MEMORY)
+    return;
+  if (heap->adaptive_sizing) {
+    resize_heap_adaptively(heap);
+    return;
+  }
+
+  // If the last collection yielded less than half of the heap, grow the
+  // heap, so that we don't collect again as soon.
+  if (heap->size >= heap->maximum_size)
+    return;
+  if (heap->count == 0)
+    return;
+  if (heap_last_gc_yield(heap) >= 0.5)
+    return;
+  heap_grow(heap, heap->size / 2);
+}
+
+// Collection didn't free enough memory for an allocation of BYTES
+// bytes; grow the heap if we can.  Return 0 if the heap is already at
+// its maximum size.
+static int grow_heap_for_allocation(struct mutator *mut, size_t bytes) {
+  struct heap *heap = mutator_heap(mut);
+  int grew = 1;
+  heap_lock(heap);
+  if (mutators_are_stopping(heap))
+    // Someone else is collecting; perhaps that will free enough.
+    pause_mutator_for_collection_with_lock(mut);
+  else
+    grew = heap_grow(heap, bytes > heap->size / 2 ? bytes : heap->size / 2);
+  heap_unlock(heap);
+  return grew;
 }
 
 static double heap_last_gc_yield(struct heap *heap) {
@@ -1024,7 +1836,7 @@ static double heap_last_gc_yield(struct heap *heap) {
 static double heap_fragmentation(struct heap *heap) {
   struct mark_space *mark_space = heap_mark_space(heap);
   size_t mark_space_blocks = mark_space->nslabs * NONMETA_BLOCKS_PER_SLAB;
-  mark_space_blocks -= atomic_load(&mark_space->unavailable.count);
+  mark_space_blocks -= mark_space_unavailable_block_count(mark_space);
   size_t mark_space_granules = mark_space_blocks * GRANULES_PER_BLOCK;
   size_t fragmentation_granules =
     mark_space->fragmentation_granules_since_last_collection;
@@ -1048,6 +1860,11 @@ static void determine_collection_kind(struct heap *heap,
       // Let's evacuate to maximize the free block yield.
       heap->gc_kind = GC_KIND_COMPACT;
       break;
+    case GC_REASON_OUT_OF_MEMORY:
+      // Compacting may free enough contiguous space where marking in
+      // place did not.
+      heap->gc_kind = GC_KIND_COMPACT;
+      break;
     case GC_REASON_SMALL_ALLOCATION: {
       // We are making a small allocation and ran out of blocks.
       // Evacuate if the heap is "too fragmented", where fragmentation
@@ -1082,7 +1899,53 @@ static void determine_collection_kind(struct heap *heap,
 static void release_evacuation_target_blocks(struct mark_space *space) {
   // Move any collected evacuation target blocks back to empties.
   finish_evacuation_allocator(&space->evacuation_allocator,
-                              &space->evacuation_targets, &space->empty);
+                              &space->evacuation_targets, space);
+}
+
+// For an emergency collection, use all empty blocks as evacuation
+// targets, instead of the usual reserve, so that we can evacuate as
+// many fragmented blocks as possible.  A heap that is too fragmented to
+// satisfy an allocation may well have no empty blocks at all, though,
+// so additionally borrow unavailable blocks, up to a quarter of the
+// mark space, and ask for them to be released again as soon as
+// compaction frees enough blocks.  Targets that aren't used go back to
+// the empties afterwards.
+#define EMERGENCY_EVACUATION_RESERVE 0.25
+
+static void push_emergency_evacuation_target(struct mark_space *space,
+                                             uintptr_t block) {
+  struct block_summary *summary = block_summary_for_addr(block);
+  summary->hole_count = 1;
+  summary->free_granules = GRANULES_PER_BLOCK;
+  summary->holes_with_fragmentation = 0;
+  summary->fragmentation_granules = 0;
+  push_block(&space->evacuation_targets, block);
+}
+
+static void reserve_empty_blocks_for_evacuation(struct mark_space *space) {
+  uintptr_t block;
+  while ((block = pop_empty_block(space)))
+    push_emergency_evacuation_target(space, block);
+
+  size_t total = space->nslabs * NONMETA_BLOCKS_PER_SLAB;
+  size_t available = total - mark_space_unavailable_block_count(space);
+  size_t targets = space->evacuation_targets.count;
+  size_t borrowed = 0;
+  while (targets + borrowed < available * EMERGENCY_EVACUATION_RESERVE) {
+    if (reacquire_fresh_block(space)) {
+      block = pop_empty_block(space);
+    } else {
+      block = pop_unavailable_block(space);
+      if (!block)
+        break;
+    }
+    push_emergency_evacuation_target(space, block);
+    borrowed++;
+  }
+  if (borrowed) {
+    DEBUG("borrowed %zu unavailable blocks for evacuation\n", borrowed);
+    mark_space_request_release_memory(space, borrowed * BLOCK_SIZE);
+  }
 }
 
 static void prepare_for_evacuation(struct heap *heap) {
@@ -1116,15 +1979,16 @@ static void prepare_for_evacuation(struct heap *heap) {
   const size_t bucket_count = 33;
   size_t histogram[33] = {0,};
   size_t bucket_size = GRANULES_PER_BLOCK / 32;
-  for (size_t slab = 0; slab < space->nslabs; slab++) {
-    for (size_t block = 0; block < NONMETA_BLOCKS_PER_SLAB; block++) {
-      struct block_summary *summary = &space->slabs[slab].summaries[block];
-      if (block_summary_has_flag(summary, BLOCK_UNAVAILABLE))
-        continue;
-      size_t survivor_granules = GRANULES_PER_BLOCK - summary->free_granules;
-      size_t bucket = (survivor_granules + bucket_size - 1) / bucket_size;
-      histogram[bucket]++;
-    }
+  // Fresh blocks have never been used, so they can't be candidates.
+  size_t nblocks = fresh_blocks_claimed(space->fresh_blocks);
+  for (size_t i = 0; i < nblocks; i++) {
+    uintptr_t block = mark_space_block_at_index(space, i);
+    struct block_summary *summary = block_summary_for_addr(block);
+    if (block_summary_has_flag(summary, BLOCK_UNAVAILABLE))
+      continue;
+    size_t survivor_granules = GRANULES_PER_BLOCK - summary->free_granules;
+    size_t bucket = (survivor_granules + bucket_size - 1) / bucket_size;
+    histogram[bucket]++;
   }
 
   // Evacuation targets must be in bucket 0.  These blocks will later be
@@ -1147,19 +2011,18 @@ static void prepare_for_evacuation(struct heap *heap) {
 
   // Having selected the number of blocks, now we set the evacuation
   // candidate flag on all blocks.
-  for (size_t slab = 0; slab < space->nslabs; slab++) {
-    for (size_t block = 0; block < NONMETA_BLOCKS_PER_SLAB; block++) {
-      struct block_summary *summary = &space->slabs[slab].summaries[block];
-      if (block_summary_has_flag(summary, BLOCK_UNAVAILABLE))
-        continue;
-      size_t survivor_granules = GRANULES_PER_BLOCK - summary->free_granules;
-      size_t bucket = (survivor_granules + bucket_size - 1) / bucket_size;
-      if (histogram[bucket]) {
-        block_summary_set_flag(summary, BLOCK_EVACUATE);
-        histogram[bucket]--;
-      } else {
-        block_summary_clear_flag(summary, BLOCK_EVACUATE);
-      }
+  for (size_t i = 0; i < nblocks; i++) {
+    uintptr_t block = mark_space_block_at_index(space, i);
+    struct block_summary *summary = block_summary_for_addr(block);
+    if (block_summary_has_flag(summary, BLOCK_UNAVAILABLE))
+      continue;
+    size_t survivor_granules = GRANULES_PER_BLOCK - summary->free_granules;
+    size_t bucket = (survivor_granules + bucket_size - 1) / bucket_size;
+    if (histogram[bucket]) {
+      block_summary_set_flag(summary, BLOCK_EVACUATE);
+      histogram[bucket]--;
+    } else {
+      block_summary_clear_flag(summary, BLOCK_EVACUATE);
     }
   }
 
@@ -1192,11 +2055,8 @@ static void collect(struct mutator *mut, enum gc_reason reason) {
   struct heap *heap = mutator_heap(mut);
   struct mark_space *space = heap_mark_space(heap);
   struct large_object_space *lospace = heap_large_object_space(heap);
-  if (maybe_grow_heap(heap, reason)) {
-    DEBUG("grew heap instead of collecting #%ld:\n", heap->count);
-    return;
-  }
   DEBUG("start collect #%ld:\n", heap->count);
+  uint64_t start_usec = current_usec();
   determine_collection_kind(heap, reason);
   large_object_space_start_gc(lospace);
   tracer_prepare(heap);
@@ -1204,10 +2064,21 @@ static void collect(struct mutator *mut, enum gc_reason reason) {
   trace_mutator_roots_with_lock_before_stop(mut);
   finish_sweeping(mut);
   wait_for_mutators_to_stop(heap);
+  pause_background_sweepers(heap);
+  finish_sweeping_for_deactivated_mutators(heap);
+  finish_sweeping_deferred_blocks(space);
+  release_swept_blocks(space);
+  // All of the last cycle's blocks are swept now.
   double yield = heap_last_gc_yield(heap);
   double fragmentation = heap_fragmentation(heap);
-  fprintf(stderr, "last gc yield: %f; fragmentation: %f\n", yield, fragmentation);
+  fprintf(stderr, "last gc yield: %f; fragmentation: %f; deferred blocks: %zu\n",
+          yield, fragmentation, space->deferred_blocks_since_last_collection);
+  maybe_resize_heap(heap, reason);
   trace_conservative_roots_after_stop(heap);
+  if (reason == GC_REASON_OUT_OF_MEMORY) {
+    reserve_empty_blocks_for_evacuation(space);
+    heap->emergency_collection_count++;
+  }
   prepare_for_evacuation(heap);
   trace_precise_roots_after_stop(heap);
   tracer_trace(heap);
@@ -1217,6 +2088,10 @@ static void collect(struct mutator *mut, enum gc_reason reason) {
   heap->count++;
   heap_reset_large_object_pages(heap, lospace->live_pages_at_last_collection);
   allow_mutators_to_continue(heap);
+  resume_background_sweepers(heap);
+  mark_space_decommit_queued_blocks(space);
+  heap->last_gc_end_usec = current_usec();
+  heap->last_gc_usec = heap->last_gc_end_usec - start_usec;
   DEBUG("collect done\n");
 }
 
@@ -1245,66 +2120,90 @@ static int sweep_word(uintptr_t *loc, uintptr_t sweep_mask) {
   return 0;
 }
 
-static inline uint64_t load_mark_bytes(uint8_t *mark) {
-  ASSERT(((uintptr_t)mark & 7) == 0);
-  uint8_t * __attribute__((aligned(8))) aligned_mark = mark;
-  uint64_t word;
-  memcpy(&word, aligned_mark, 8);
-#ifdef WORDS_BIGENDIAN
-  word = __builtin_bswap64(word);
-#endif
-  return word;
-}
-
-static inline size_t count_zero_bytes(uint64_t bytes) {
-  return bytes ? (__builtin_ctz(bytes) / 8) : sizeof(bytes);
-}
-
 static size_t next_mark(uint8_t *mark, size_t limit, uint64_t sweep_mask) {
-  size_t n = 0;
-  // If we have a hole, it is likely to be more that 8 granules long.
-  // Assuming that it's better to make aligned loads, first we align the
-  // sweep pointer, then we load aligned mark words.
-  size_t unaligned = ((uintptr_t) mark) & 7;
-  if (unaligned) {
-    uint64_t bytes = load_mark_bytes(mark - unaligned) >> (unaligned * 8);
-    bytes &= sweep_mask;
-    if (bytes)
-      return count_zero_bytes(bytes);
-    n += 8 - unaligned;
-  }
-
-  for(; n < limit; n += 8) {
-    uint64_t bytes = load_mark_bytes(mark + n);
-    bytes &= sweep_mask;
-    if (bytes)
-      return n + count_zero_bytes(bytes);
-  }
-
-  return limit;
+  return scan_for_byte_with_bits(mark, limit, sweep_mask);
 }
 
-static uintptr_t mark_space_next_block_to_sweep(struct mark_space *space) {
-  uintptr_t block = atomic_load_explicit(&space->next_block,
-                                         memory_order_acquire);
-  uintptr_t next_block;
-  do {
+static uintptr_t claim_sweep_run(struct mark_space *space,
+                                 struct sweep_run *run, size_t node) {
+  uintptr_t *cursor = &space->next_block[node];
+  uintptr_t block = atomic_load_explicit(cursor, memory_order_acquire);
+  uintptr_t limit, next_block;
+  while (1) {
     if (block == 0)
       return 0;
 
-    next_block = block + BLOCK_SIZE;
+    // Slabs start with their metadata blocks, so BLOCK is never at the
+    // start of a slab.
+    uintptr_t slab_limit = align_up(block, SLAB_SIZE);
+    limit = block + SWEEP_RUN_BLOCKS * BLOCK_SIZE;
+    if (limit > slab_limit)
+      limit = slab_limit;
+
+    next_block = limit;
     if (next_block % SLAB_SIZE == 0) {
+      // Skip to the node's next slab.
       uintptr_t hi_addr = space->low_addr + space->extent;
-      if (next_block == hi_addr)
+      next_block += (space->numa_nodes - 1) * SLAB_SIZE;
+      if (next_block >= hi_addr)
         next_block = 0;
       else
         next_block += META_BLOCKS_PER_SLAB * BLOCK_SIZE;
     }
-  } while (!atomic_compare_exchange_weak(&space->next_block, &block,
-                                         next_block));
+    if (atomic_compare_exchange_weak(cursor, &block, next_block))
+      break;
+    run->retries++;
+  }
+  run->claims++;
+  run->next = block + BLOCK_SIZE;
+  run->limit = limit;
   return block;
 }
 
+// Return the next block to sweep, preferring blocks on NODE, or 0 if
+// all blocks have been claimed.
+static uintptr_t mark_space_next_block_to_sweep(struct mark_space *space,
+                                                struct sweep_run *run,
+                                                size_t node) {
+  if (run->next != run->limit) {
+    uintptr_t block = run->next;
+    run->next += BLOCK_SIZE;
+    return block;
+  }
+
+  for (size_t i = 0; i < space->numa_nodes; i++) {
+    uintptr_t block =
+      claim_sweep_run(space, run, (node + i) % space->numa_nodes);
+    if (block)
+      return block;
+  }
+  return 0;
+}
+
+static void update_maximum(size_t *loc, size_t val) {
+  size_t cur = atomic_load_explicit(loc, memory_order_relaxed);
+  while (cur < val && !atomic_compare_exchange_weak(loc, &cur, val));
+}
+
+// Add the claim statistics of RUN to its thread's totals and to STATS,
+// and reset them.
+static void flush_sweep_run_statistics(struct sweep_run *run,
+                                       struct sweep_statistics *stats) {
+  atomic_fetch_add(&stats->claims, run->claims);
+  atomic_fetch_add(&stats->retries, run->retries);
+  run->thread_claims += run->claims;
+  run->thread_retries += run->retries;
+  update_maximum(&stats->max_thread_claims, run->thread_claims);
+  update_maximum(&stats->max_thread_retries, run->thread_retries);
+  run->claims = run->retries = 0;
+}
+
+static void flush_mutator_sweep_run_statistics(struct mutator *mut) {
+  struct heap *heap = mutator_heap(mut);
+  flush_sweep_run_statistics(&mut->sweep_run,
+                             &heap->mutator_sweep_statistics);
+}
+
 static void finish_block(struct mutator *mut) {
   ASSERT(mut->block);
   struct block_summary *block = block_summary_for_addr(mut->block);
@@ -1313,6 +2212,7 @@ static void finish_block(struct mutator *mut) {
                    block->free_granules);
   atomic_fetch_add(&space->fragmentation_granules_since_last_collection,
                    block->fragmentation_granules);
+  block_summary_clear_flag(block, BLOCK_SWEPT);
 
   mut->block = mut->alloc = mut->sweep = 0;
 }
@@ -1353,9 +2253,13 @@ static size_t next_hole_in_block(struct mutator *mut) {
     ASSERT(free_granules);
     ASSERT(free_granules <= limit_granules);
 
+    // If a background sweeper got to this block first, it already
+    // counted this hole.
     struct block_summary *summary = block_summary_for_addr(sweep);
-    summary->hole_count++;
-    summary->free_granules += free_granules;
+    if (!block_summary_has_flag(summary, BLOCK_SWEPT)) {
+      summary->hole_count++;
+      summary->free_granules += free_granules;
+    }
 
     size_t free_bytes = free_granules * GRANULE_SIZE;
     mut->alloc = sweep;
@@ -1380,6 +2284,16 @@ static void finish_hole(struct mutator *mut) {
   // FIXME: add to fragmentation
 }
 
+// The mutator's current block turned out to be entirely empty; put it
+// on the mutator's empties, instead of allocating into it.
+static void push_swept_empty_block(struct mutator *mut) {
+  ASSERT(mut->block);
+  struct block_summary *summary = block_summary_for_addr(mut->block);
+  block_summary_clear_flag(summary, BLOCK_NEEDS_SWEEP);
+  push_empty_block_for_mutator(mut, mut->block);
+  mut->alloc = mut->sweep = mut->block = 0;
+}
+
 static int maybe_release_swept_empty_block(struct mutator *mut) {
   ASSERT(mut->block);
   struct mark_space *space = heap_mark_space(mutator_heap(mut));
@@ -1395,13 +2309,63 @@ static int maybe_release_swept_empty_block(struct mutator *mut) {
   return 1;
 }
 
+// A block that had only a little free space after the last collection
+// is likely to be nearly full after this one too.  Sweeping it yields
+// little, and its holes are too small for most allocations, so using
+// it just adds to fragmentation.  We defer sweeping such blocks until
+// the others are used up.
+#define DEFERRED_BLOCK_FREE_GRANULES (GRANULES_PER_BLOCK / 16)
+
+static int block_is_nearly_full(struct block_summary *summary) {
+  return summary->free_granules < DEFERRED_BLOCK_FREE_GRANULES;
+}
+
+static void start_sweeping_block(struct mutator *mut, uintptr_t block) {
+  // As we sweep we'll want to record how many bytes were live at the
+  // last collection.  As we allocate we'll record how many granules
+  // were wasted because of fragmentation.
+  struct block_summary *summary = block_summary_for_addr(block);
+  summary->hole_count = 0;
+  summary->free_granules = 0;
+  summary->holes_with_fragmentation = 0;
+  summary->fragmentation_granules = 0;
+  mut->alloc = mut->sweep = mut->block = block;
+}
+
+// Take a completely empty block for allocation, or return 0 if the
+// empties list is exhausted.  The block is marked as out for the
+// thread, so that no sweeper visits it in this cycle.  The caller is
+// responsible for setting BLOCK_NEEDS_SWEEP, so that it is swept after
+// the next collection.
+static uintptr_t take_empty_block(struct mutator *mut) {
+  struct mark_space *space = heap_mark_space(mutator_heap(mut));
+  while (1) {
+    uintptr_t block = pop_empty_block_for_mutator(mut);
+    if (!block)
+      return 0;
+
+    // Maybe we should use this empty as a target for evacuation.
+    if (maybe_push_evacuation_target(space, block))
+      continue;
+
+    struct block_summary *summary = block_summary_for_addr(block);
+    summary->hole_count = 1;
+    summary->free_granules = GRANULES_PER_BLOCK;
+    summary->holes_with_fragmentation = 0;
+    summary->fragmentation_granules = 0;
+    block_summary_set_flag(summary, BLOCK_OUT_FOR_THREAD);
+    return block;
+  }
+}
+
 static size_t next_hole(struct mutator *mut) {
   finish_hole(mut);
   // As we sweep if we find that a block is empty, we return it to the
   // empties list.  Empties are precious.  But if we return 10 blocks in
   // a row, and still find an 11th empty, go ahead and use it.
   size_t empties_countdown = 10;
-  struct mark_space *space = heap_mark_space(mutator_heap(mut));
+  struct heap *heap = mutator_heap(mut);
+  struct mark_space *space = heap_mark_space(heap);
   while (1) {
     // Sweep current block for a hole.
     size_t granules = next_hole_in_block(mut);
@@ -1414,38 +2378,52 @@ static size_t next_hole(struct mutator *mut) {
       if (maybe_release_swept_empty_block(mut))
         continue;
       // Otherwise if we've already returned lots of empty blocks to the
-      // freelist, give this block to the mutator.
-      if (!empties_countdown)
+      // freelist, give this block to the mutator, unless it is stopping
+      // and only sweeping.
+      if (!empties_countdown && !mutators_are_stopping(heap))
         return granules;
       // Otherwise we push to the empty blocks list.
-      struct block_summary *summary = block_summary_for_addr(mut->block);
-      block_summary_clear_flag(summary, BLOCK_NEEDS_SWEEP);
-      push_empty_block(space, mut->block);
-      mut->alloc = mut->sweep = mut->block = 0;
+      push_swept_empty_block(mut);
       empties_countdown--;
     }
     ASSERT(mut->block == 0);
+    // Take blocks already swept by background sweepers first.  If
+    // mutators are stopping for collection, they need no further
+    // sweeping; leave them to the collector.
+    if (!mutators_are_stopping(heap)) {
+      uintptr_t block = 0;
+      for (size_t i = 0; i < space->numa_nodes && !block; i++)
+        block = pop_block(&space->swept[(mut->numa_node + i)
+                                        % space->numa_nodes]);
+      if (block) {
+        mut->alloc = mut->sweep = mut->block = block;
+        continue;
+      }
+    }
     while (1) {
-      uintptr_t block = mark_space_next_block_to_sweep(space);
+      uintptr_t block = mark_space_next_block_to_sweep(space, &mut->sweep_run,
+                                                       mut->numa_node);
       if (block) {
         // Sweeping found a block.  We might take it for allocation, or
         // we might send it back.
         struct block_summary *summary = block_summary_for_addr(block);
         // If it's marked unavailable, it's already on a list of
-        // unavailable blocks, so skip and get the next block.
-        if (block_summary_has_flag(summary, BLOCK_UNAVAILABLE))
+        // unavailable blocks; if it's out for a thread, a mutator took
+        // it from the empties in this cycle.  Either way, skip it and
+        // get the next block.
+        if (block_summary_has_flag(summary,
+                                   BLOCK_UNAVAILABLE | BLOCK_OUT_FOR_THREAD))
           continue;
         if (block_summary_has_flag(summary, BLOCK_NEEDS_SWEEP)) {
           // This block was marked in the last GC and needs sweeping.
-          // As we sweep we'll want to record how many bytes were live
-          // at the last collection.  As we allocate we'll record how
-          // many granules were wasted because of fragmentation.
-          summary->hole_count = 0;
-          summary->free_granules = 0;
-          summary->holes_with_fragmentation = 0;
-          summary->fragmentation_granules = 0;
-          // Prepare to sweep the block for holes.
-          mut->alloc = mut->sweep = mut->block = block;
+          // Unless its summary from the last cycle shows it to be
+          // nearly full, prepare to sweep the block for holes.
+          if (block_is_nearly_full(summary)) {
+            push_block(&space->deferred, block);
+            atomic_fetch_add(&space->deferred_blocks_since_last_collection, 1);
+            continue;
+          }
+          start_sweeping_block(mut, block);
           break;
         } else {
           // Otherwise this block is completely empty and is on the
@@ -1454,24 +2432,38 @@ static size_t next_hole(struct mutator *mut) {
           continue;
         }
       } else {
-        // We are done sweeping for blocks.  Now take from the empties
-        // list.
-        block = pop_empty_block(space);
-        // No empty block?  Return 0 to cause collection.
-        if (!block)
+        // We are done sweeping for blocks.  Sweep the nearly-full
+        // blocks that we deferred, if any.
+        block = pop_block(&space->deferred);
+        if (block) {
+          start_sweeping_block(mut, block);
+          break;
+        }
+
+        // If mutators are stopping for collection, sweeping is all
+        // that is left to do.  Don't take empty or fresh blocks, which
+        // would only get their metadata cleared and be swept for no
+        // reason after the collection.
+        if (mutators_are_stopping(heap))
           return 0;
 
-        // Maybe we should use this empty as a target for evacuation.
-        if (maybe_push_evacuation_target(space, block))
-          continue;
+        // Now take from the empties list.
+        block = take_empty_block(mut);
+        if (!block) {
+          // Background sweepers may still be working through blocks
+          // that they claimed before the cursor ran out.  Wait for them,
+          // and look again if they left any swept or empty blocks.
+          // Otherwise return 0 to cause collection.
+          if (!mutators_are_stopping(heap)
+              && wait_for_background_sweepers(heap))
+            break;
+          return 0;
+        }
 
-        // Otherwise return the block to the mutator.
-        struct block_summary *summary = block_summary_for_addr(block);
-        block_summary_set_flag(summary, BLOCK_NEEDS_SWEEP);
-        summary->hole_count = 1;
-        summary->free_granules = GRANULES_PER_BLOCK;
-        summary->holes_with_fragmentation = 0;
-        summary->fragmentation_granules = 0;
+        // The block is out for this thread, so no other mutator will
+        // try to sweep it in this cycle.
+        block_summary_set_flag(block_summary_for_addr(block),
+                               BLOCK_NEEDS_SWEEP);
         mut->block = block;
         mut->alloc = block;
         mut->sweep = block + BLOCK_SIZE;
@@ -1481,9 +2473,60 @@ static size_t next_hole(struct mutator *mut) {
   }
 }
 
+// Release the mutator's overflow block, if any.  The unused tail of
+// the block counts as fragmentation, as for the tail of a hole.  While
+// in use, the overflow block is not marked as needing a sweep.  Like
+// any block taken from the empties, it is out for the thread, so no
+// one sweeps it until after the next collection.
+static void finish_overflow_block(struct mutator *mut) {
+  if (!mut->overflow_block)
+    return;
+  struct block_summary *summary = block_summary_for_addr(mut->overflow_block);
+  size_t granules = (mut->overflow_sweep - mut->overflow_alloc) / GRANULE_SIZE;
+  if (granules) {
+    summary->holes_with_fragmentation++;
+    summary->fragmentation_granules += granules;
+    uint8_t *metadata = object_metadata_byte((void*)mut->overflow_alloc);
+    memset(metadata, 0, granules);
+  }
+  struct mark_space *space = heap_mark_space(mutator_heap(mut));
+  atomic_fetch_add(&space->granules_freed_by_last_collection,
+                   summary->free_granules);
+  atomic_fetch_add(&space->fragmentation_granules_since_last_collection,
+                   summary->fragmentation_granules);
+  block_summary_set_flag(summary, BLOCK_NEEDS_SWEEP);
+  mut->overflow_block = mut->overflow_alloc = mut->overflow_sweep = 0;
+}
+
 static void finish_sweeping_in_block(struct mutator *mut) {
   while (next_hole_in_block(mut))
     finish_hole(mut);
+  // Any blocks remaining in the mutator's claimed run have to be swept
+  // now too, as no one else will find them.
+  struct sweep_run *run = &mut->sweep_run;
+  while (run->next != run->limit) {
+    uintptr_t block = run->next;
+    run->next += BLOCK_SIZE;
+    struct block_summary *summary = block_summary_for_addr(block);
+    if (block_summary_has_flag(summary,
+                               BLOCK_UNAVAILABLE | BLOCK_OUT_FOR_THREAD) ||
+        !block_summary_has_flag(summary, BLOCK_NEEDS_SWEEP))
+      continue;
+    start_sweeping_block(mut, block);
+    size_t granules = next_hole_in_block(mut);
+    // As in next_hole, an empty block goes to the empties; it is not one
+    // big hole left unused.
+    if (granules == GRANULES_PER_BLOCK) {
+      if (!maybe_release_swept_empty_block(mut))
+        push_swept_empty_block(mut);
+      continue;
+    }
+    for (; granules; granules = next_hole_in_block(mut))
+      finish_hole(mut);
+  }
+  finish_overflow_block(mut);
+  flush_empty_blocks_for_mutator(mut);
+  flush_mutator_sweep_run_statistics(mut);
 }
 
 // Another thread is triggering GC.  Before we stop, finish clearing the
@@ -1491,17 +2534,230 @@ static void finish_sweeping_in_block(struct mutator *mut) {
 static void finish_sweeping(struct mutator *mut) {
   while (next_hole(mut))
     finish_hole(mut);
+  finish_overflow_block(mut);
+  flush_empty_blocks_for_mutator(mut);
+  flush_mutator_sweep_run_statistics(mut);
+}
+
+// Background sweeping.  A sweeper sweeps a whole block at a time,
+// clearing the metadata and memory of each hole and recording the
+// block's hole summary.  Empty blocks go to the empties list, or are
+// released to the OS if we have pending unavailable bytes; blocks with
+// holes go on the swept list.
+static void sweeper_sweep_block(struct mark_space *space, uintptr_t block) {
+  struct block_summary *summary = block_summary_for_addr(block);
+  if (block_summary_has_flag(summary,
+                             BLOCK_UNAVAILABLE | BLOCK_OUT_FOR_THREAD) ||
+      !block_summary_has_flag(summary, BLOCK_NEEDS_SWEEP))
+    return;
+
+  summary->hole_count = 0;
+  summary->free_granules = 0;
+  summary->holes_with_fragmentation = 0;
+  summary->fragmentation_granules = 0;
+
+  uintptr_t sweep_mask = space->sweep_mask;
+  uintptr_t sweep = block;
+  uintptr_t limit = block + BLOCK_SIZE;
+  while (sweep != limit) {
+    uint8_t* metadata = object_metadata_byte((struct gcobj*)sweep);
+    size_t limit_granules = (limit - sweep) >> GRANULE_SIZE_LOG_2;
+    if (metadata[0] & sweep_mask) {
+      sweep += mark_space_live_object_granules(metadata) * GRANULE_SIZE;
+      continue;
+    }
+    size_t free_granules = next_mark(metadata, limit_granules, sweep_mask);
+    memset(metadata, 0, free_granules);
+    clear_memory(sweep, free_granules * GRANULE_SIZE);
+    summary->hole_count++;
+    summary->free_granules += free_granules;
+    sweep += free_granules * GRANULE_SIZE;
+  }
+
+  if (summary->free_granules == GRANULES_PER_BLOCK) {
+    block_summary_clear_flag(summary, BLOCK_NEEDS_SWEEP);
+    if (atomic_load_explicit(&space->pending_unavailable_bytes,
+                             memory_order_acquire) > 0) {
+      push_unavailable_block(space, block);
+      atomic_fetch_sub(&space->pending_unavailable_bytes, BLOCK_SIZE);
+    } else {
+      block_summary_set_flag(summary, BLOCK_ZERO);
+      push_empty_block(space, block);
+    }
+  } else if (summary->hole_count) {
+    block_summary_set_flag(summary, BLOCK_SWEPT);
+    push_block(&space->swept[block_numa_node(space, block)], block);
+  }
+}
+
+static void* sweeper_thread(void *data) {
+  struct heap *heap = data;
+  struct sweepers *sweepers = &heap->sweepers;
+  struct mark_space *space = heap_mark_space(heap);
+  long epoch = 0;
+  struct sweep_run run = { 0, };
+  atomic_fetch_add(&heap->sweeper_sweep_statistics.threads, 1);
+
+  pthread_mutex_lock(&sweepers->lock);
+  while (1) {
+    while (atomic_load(&sweepers->paused) || sweepers->epoch == epoch)
+      pthread_cond_wait(&sweepers->cond, &sweepers->lock);
+    epoch = sweepers->epoch;
+    sweepers->active++;
+    pthread_mutex_unlock(&sweepers->lock);
+
+    run.next = run.limit = 0;
+    size_t node = current_numa_node(space);
+    while (!atomic_load_explicit(&sweepers->paused, memory_order_acquire)) {
+      uintptr_t block = mark_space_next_block_to_sweep(space, &run, node);
+      if (!block)
+        block = pop_block(&space->deferred);
+      if (!block)
+        break;
+      sweeper_sweep_block(space, block);
+    }
+    // If we were paused, finish the rest of our claimed run.
+    for (; run.next != run.limit; run.next += BLOCK_SIZE)
+      sweeper_sweep_block(space, run.next);
+    flush_sweep_run_statistics(&run, &heap->sweeper_sweep_statistics);
+    mark_space_decommit_queued_blocks(space);
+
+    pthread_mutex_lock(&sweepers->lock);
+    if (--sweepers->active == 0)
+      pthread_cond_broadcast(&sweepers->idle_cond);
+  }
+  return NULL;
+}
+
+static int sweepers_init(struct heap *heap) {
+  struct sweepers *sweepers = &heap->sweepers;
+  pthread_mutex_init(&sweepers->lock, NULL);
+  pthread_cond_init(&sweepers->cond, NULL);
+  pthread_cond_init(&sweepers->idle_cond, NULL);
+  size_t desired_count = 0;
+  if (getenv("GC_SWEEPERS"))
+    desired_count = atoi(getenv("GC_SWEEPERS"));
+  for (size_t i = 0; i < desired_count; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sweeper_thread, heap)) {
+      perror("spawning sweeper thread failed");
+      break;
+    }
+    sweepers->count++;
+  }
+  return 1;
+}
+
+// Precondition: the caller holds the heap lock.
+static void pause_background_sweepers(struct heap *heap) {
+  struct sweepers *sweepers = &heap->sweepers;
+  if (!sweepers->count)
+    return;
+  pthread_mutex_lock(&sweepers->lock);
+  atomic_store_explicit(&sweepers->paused, 1, memory_order_release);
+  while (sweepers->active)
+    pthread_cond_wait(&sweepers->idle_cond, &sweepers->lock);
+  pthread_mutex_unlock(&sweepers->lock);
+}
+
+static void resume_background_sweepers(struct heap *heap) {
+  struct sweepers *sweepers = &heap->sweepers;
+  if (!sweepers->count)
+    return;
+  pthread_mutex_lock(&sweepers->lock);
+  atomic_store_explicit(&sweepers->paused, 0, memory_order_release);
+  sweepers->epoch++;
+  pthread_cond_broadcast(&sweepers->cond);
+  pthread_mutex_unlock(&sweepers->lock);
+}
+
+// A mutator found no block to sweep and no empty block.  Wait for the
+// background sweepers to finish the blocks that they have claimed, then
+// return 1 if there are swept or empty blocks to take after all, or 0
+// if the heap is exhausted.
+static int wait_for_background_sweepers(struct heap *heap) {
+  struct sweepers *sweepers = &heap->sweepers;
+  if (!sweepers->count)
+    return 0;
+  pthread_mutex_lock(&sweepers->lock);
+  while (sweepers->active)
+    pthread_cond_wait(&sweepers->idle_cond, &sweepers->lock);
+  pthread_mutex_unlock(&sweepers->lock);
+  struct mark_space *space = heap_mark_space(heap);
+  for (size_t node = 0; node < space->numa_nodes; node++) {
+    if (atomic_load_explicit(&space->swept[node].count, memory_order_acquire)
+        || atomic_load_explicit(&space->empty[node].count,
+                                memory_order_acquire))
+      return 1;
+  }
+  return 0;
 }
 
-static void out_of_memory(struct mutator *mut) {
+// Nearly-full blocks deferred while sweeping stay marked as needing a
+// sweep.  Stopping mutators normally sweep them all, as they drain the
+// deferred list before returning from next_hole, but if any are left,
+// sweep them here: marking would otherwise find their dead objects'
+// metadata under the rotated mark bits.  Mutators and background
+// sweepers are stopped, so we have the list to ourselves.
+static void finish_sweeping_deferred_blocks(struct mark_space *space) {
+  uintptr_t block;
+  while ((block = pop_block(&space->deferred)))
+    sweeper_sweep_block(space, block);
+}
+
+// Blocks on the swept list that no mutator got to before the collection
+// already have their dead metadata cleared.  Just account for their
+// free space.
+static void release_swept_blocks(struct mark_space *space) {
+  for (size_t node = 0; node < space->numa_nodes; node++) {
+    uintptr_t block;
+    while ((block = pop_block(&space->swept[node]))) {
+      struct block_summary *summary = block_summary_for_addr(block);
+      block_summary_clear_flag(summary, BLOCK_SWEPT);
+      space->granules_freed_by_last_collection += summary->free_granules;
+    }
+  }
+}
+
+// Set a handler to call when an allocation of BYTES bytes fails, even
+// after an emergency compacting collection.  If the handler returns
+// nonzero, perhaps having dropped some references, the allocation is
+// retried, collecting again if needed; otherwise the process aborts.
+static void set_out_of_memory_handler(struct heap *heap,
+                                      int (*handler)(struct mutator *mut,
+                                                     size_t bytes)) {
+  heap->out_of_memory_handler = handler;
+}
+
+// Return nonzero if the out-of-memory handler asks us to retry the
+// allocation; otherwise abort.
+static int out_of_memory(struct mutator *mut, size_t bytes) {
   struct heap *heap = mutator_heap(mut);
+  if (heap->out_of_memory_handler && heap->out_of_memory_handler(mut, bytes))
+    return 1;
   fprintf(stderr, "ran out of space, heap size %zu (%zu slabs)\n",
           heap->size, heap_mark_space(heap)->nslabs);
   abort();
 }
 
+// Collect for REASON, unless another thread is already collecting, in
+// which case wait for it to finish.  Return 1 if we collected.
+static int trigger_collection(struct mutator *mut, enum gc_reason reason) {
+  struct heap *heap = mutator_heap(mut);
+  int collected = 0;
+  heap_lock(heap);
+  if (mutators_are_stopping(heap)) {
+    pause_mutator_for_collection_with_lock(mut);
+  } else {
+    collect(mut, reason);
+    collected = 1;
+  }
+  heap_unlock(heap);
+  return collected;
+}
+
 static void* allocate_large(struct mutator *mut, enum alloc_kind kind,
-                            size_t granules) {
+                            size_t granules, int pointerless) {
   struct heap *heap = mutator_heap(mut);
   struct large_object_space *space = heap_large_object_space(heap);
 
@@ -1511,14 +2767,19 @@ static void* allocate_large(struct mutator *mut, enum alloc_kind kind,
   mark_space_request_release_memory(heap_mark_space(heap),
                                     npages << space->page_size_log2);
   if (!sweep_until_memory_released(mut)) {
-    heap_lock(heap);
-    if (mutators_are_stopping(heap))
-      pause_mutator_for_collection_with_lock(mut);
-    else
-      collect(mut, GC_REASON_LARGE_ALLOCATION);
-    heap_unlock(heap);
-    if (!sweep_until_memory_released(mut))
-      out_of_memory(mut);
+    trigger_collection(mut, GC_REASON_LARGE_ALLOCATION);
+    int compacted = 0;
+    while (!sweep_until_memory_released(mut)) {
+      if (grow_heap_for_allocation(mut, size))
+        continue;
+      if (!compacted) {
+        compacted = trigger_collection(mut, GC_REASON_OUT_OF_MEMORY);
+      } else if (out_of_memory(mut, size)) {
+        // Start over, so the handler's dropped references get collected.
+        trigger_collection(mut, GC_REASON_LARGE_ALLOCATION);
+        compacted = 0;
+      }
+    }
   }
   atomic_fetch_add(&heap->large_object_pages, npages);
 
@@ -1531,43 +2792,113 @@ static void* allocate_large(struct mutator *mut, enum alloc_kind kind,
     abort();
   }
 
-  *(uintptr_t*)ret = tag_live(kind);
+  // Large object pages are fresh from mmap or were released with
+  // madvise when last freed, so they are already zeroed.
+  *(uintptr_t*)ret = tag_live(kind, pointerless);
   return ret;
 }
 
-static void* allocate_small_slow(struct mutator *mut, enum alloc_kind kind,
-                                 size_t granules) NEVER_INLINE;
-static void* allocate_small_slow(struct mutator *mut, enum alloc_kind kind,
-                                 size_t granules) {
+// Sweep until we find a hole with room for GRANULES granules,
+// collecting if needed, and prepare the hole for allocation.
+static void acquire_hole(struct mutator *mut, size_t granules) NEVER_INLINE;
+static void acquire_hole(struct mutator *mut, size_t granules) {
   int swept_from_beginning = 0;
+  int compacted = 0;
   while (1) {
     size_t hole = next_hole(mut);
     if (hole >= granules) {
-      clear_memory(mut->alloc, hole * GRANULE_SIZE);
+      // Blocks fresh from the OS are already zeroed, and a background
+      // sweeper clears the holes that it finds.  Otherwise the hole is
+      // cleared as objects are allocated; see clear_for_allocation.
+      struct block_summary *summary = block_summary_for_addr(mut->block);
+      if (block_summary_has_flag(summary, BLOCK_ZERO | BLOCK_SWEPT))
+        mut->clear = mut->sweep;
+      else
+        mut->clear = mut->alloc;
+      block_summary_clear_flag(summary, BLOCK_ZERO);
       break;
     }
     if (!hole) {
-      struct heap *heap = mutator_heap(mut);
-      if (swept_from_beginning) {
-        out_of_memory(mut);
-      } else {
-        heap_lock(heap);
-        if (mutators_are_stopping(heap))
-          pause_mutator_for_collection_with_lock(mut);
-        else
-          collect(mut, GC_REASON_SMALL_ALLOCATION);
-        heap_unlock(heap);
+      size_t bytes = granules * GRANULE_SIZE;
+      if (!swept_from_beginning) {
+        trigger_collection(mut, GC_REASON_SMALL_ALLOCATION);
         swept_from_beginning = 1;
+      } else if (grow_heap_for_allocation(mut, bytes)) {
+        continue;
+      } else if (!compacted) {
+        // Last resort: compact, then sweep from the beginning again.
+        compacted = trigger_collection(mut, GC_REASON_OUT_OF_MEMORY);
+      } else if (out_of_memory(mut, bytes)) {
+        // Start over, so the handler's dropped references get collected.
+        swept_from_beginning = 0;
+        compacted = 0;
       }
     }
   }
+}
+
+// Holes and overflow blocks are not cleared in bulk when acquired, so
+// that pointerless objects, which are left uninitialized, don't pay for
+// it.  Instead a watermark tracks how much of the hole is clear.  An
+// object with fields that ends past it clears memory up to a chunk
+// beyond its end, amortizing the memset over the next few objects; a
+// pointerless object just moves the watermark past itself.
+#define CLEAR_CHUNK_BYTES 1024
+
+static void clear_chunk_for_allocation(uintptr_t *clear, uintptr_t end,
+                                       uintptr_t limit) {
+  uintptr_t new_clear = end + CLEAR_CHUNK_BYTES;
+  if (new_clear > limit)
+    new_clear = limit;
+  clear_memory(*clear, new_clear - *clear);
+  *clear = new_clear;
+}
+
+// Prepare memory up to END for an allocation, where LIMIT is the end of
+// the hole or overflow block.
+static inline void clear_for_allocation(uintptr_t *clear, uintptr_t end,
+                                        uintptr_t limit, int pointerless) {
+  if (end <= *clear)
+    return;
+  if (pointerless)
+    *clear = end;
+  else
+    clear_chunk_for_allocation(clear, end, limit);
+}
+
+static void* allocate_small_slow(struct mutator *mut, enum alloc_kind kind,
+                                 size_t granules,
+                                 int pointerless) NEVER_INLINE;
+static void* allocate_small_slow(struct mutator *mut, enum alloc_kind kind,
+                                 size_t granules, int pointerless) {
+  acquire_hole(mut, granules);
   struct gcobj* ret = (struct gcobj*)mut->alloc;
   mut->alloc += granules * GRANULE_SIZE;
+  clear_for_allocation(&mut->clear, mut->alloc, mut->sweep, pointerless);
   return ret;
 }
 
+static inline void* init_small_object(struct gcobj *obj,
+                                      enum alloc_kind kind, size_t granules,
+                                      int pointerless) {
+  obj->tag = tag_live(kind, pointerless);
+  uint8_t *metadata = object_metadata_byte(obj);
+  uint8_t head = METADATA_BYTE_YOUNG;
+  if (pointerless)
+    head |= METADATA_BYTE_POINTERLESS;
+  if (granules == 1) {
+    metadata[0] = head | METADATA_BYTE_END;
+  } else {
+    metadata[0] = head;
+    if (granules > 2)
+      memset(metadata + 1, 0, granules - 2);
+    metadata[granules - 1] = METADATA_BYTE_END;
+  }
+  return obj;
+}
+
 static inline void* allocate_small(struct mutator *mut, enum alloc_kind kind,
-                                   size_t granules) {
+                                   size_t granules, int pointerless) {
   ASSERT(granules > 0); // allocating 0 granules would be silly
   uintptr_t alloc = mut->alloc;
   uintptr_t sweep = mut->sweep;
@@ -1576,40 +2907,129 @@ static inline void* allocate_small(struct mutator *mut, enum alloc_kind kind,
   if (new_alloc <= sweep) {
     mut->alloc = new_alloc;
     obj = (struct gcobj *)alloc;
+    clear_for_allocation(&mut->clear, new_alloc, sweep, pointerless);
   } else {
-    obj = allocate_small_slow(mut, kind, granules);
+    obj = allocate_small_slow(mut, kind, granules, pointerless);
   }
-  obj->tag = tag_live(kind);
-  uint8_t *metadata = object_metadata_byte(obj);
-  if (granules == 1) {
-    metadata[0] = METADATA_BYTE_YOUNG | METADATA_BYTE_END;
-  } else {
-    metadata[0] = METADATA_BYTE_YOUNG;
-    if (granules > 2)
-      memset(metadata + 1, 0, granules - 2);
-    metadata[granules - 1] = METADATA_BYTE_END;
+  return init_small_object(obj, kind, granules, pointerless);
+}
+
+// A medium object didn't fit in the current hole.  Instead of skipping
+// the rest of the hole, which would waste it for the small objects that
+// could use it, bump-allocate the object in an overflow block, taken
+// only from the empties list.  If there are no empty blocks, fall back
+// to sweeping for a hole that is large enough.
+static void* allocate_medium_slow(struct mutator *mut, enum alloc_kind kind,
+                                  size_t granules,
+                                  int pointerless) NEVER_INLINE;
+static void* allocate_medium_slow(struct mutator *mut, enum alloc_kind kind,
+                                  size_t granules, int pointerless) {
+  size_t bytes = granules * GRANULE_SIZE;
+  if (mut->overflow_alloc + bytes > mut->overflow_sweep) {
+    finish_overflow_block(mut);
+    uintptr_t block = take_empty_block(mut);
+    if (!block)
+      return allocate_small_slow(mut, kind, granules, pointerless);
+    struct block_summary *summary = block_summary_for_addr(block);
+    mut->overflow_block = mut->overflow_alloc = block;
+    mut->overflow_sweep = block + BLOCK_SIZE;
+    if (block_summary_has_flag(summary, BLOCK_ZERO))
+      mut->overflow_clear = mut->overflow_sweep;
+    else
+      mut->overflow_clear = block;
+    block_summary_clear_flag(summary, BLOCK_ZERO);
   }
-  return obj;
+  struct gcobj *ret = (struct gcobj*)mut->overflow_alloc;
+  mut->overflow_alloc += bytes;
+  clear_for_allocation(&mut->overflow_clear, mut->overflow_alloc,
+                       mut->overflow_sweep, pointerless);
+  return ret;
 }
 
 static inline void* allocate_medium(struct mutator *mut, enum alloc_kind kind,
-                                    size_t granules) {
-  return allocate_small(mut, kind, granules);
+                                    size_t granules, int pointerless) {
+  uintptr_t alloc = mut->alloc;
+  uintptr_t sweep = mut->sweep;
+  uintptr_t new_alloc = alloc + granules * GRANULE_SIZE;
+  struct gcobj *obj;
+  if (new_alloc <= sweep) {
+    mut->alloc = new_alloc;
+    obj = (struct gcobj *)alloc;
+    clear_for_allocation(&mut->clear, new_alloc, sweep, pointerless);
+  } else {
+    obj = allocate_medium_slow(mut, kind, granules, pointerless);
+  }
+  return init_small_object(obj, kind, granules, pointerless);
 }
 
-static inline void* allocate(struct mutator *mut, enum alloc_kind kind,
-                             size_t size) {
+static inline void* allocate_object(struct mutator *mut, enum alloc_kind kind,
+                                    size_t size, int pointerless) {
   size_t granules = size_to_granules(size);
   if (granules <= MEDIUM_OBJECT_GRANULE_THRESHOLD)
-    return allocate_small(mut, kind, granules);
+    return allocate_small(mut, kind, granules, pointerless);
   if (granules <= LARGE_OBJECT_GRANULE_THRESHOLD)
-    return allocate_medium(mut, kind, granules);
-  return allocate_large(mut, kind, granules);
+    return allocate_medium(mut, kind, granules, pointerless);
+  return allocate_large(mut, kind, granules, pointerless);
+}
+static inline void* allocate(struct mutator *mut, enum alloc_kind kind,
+                             size_t size) {
+  return allocate_object(mut, kind, size, 0);
 }
+// Allocate an object with no fields to trace.  Its contents, apart from
+// the header word, are uninitialized: unlike objects with fields, it is
+// not cleared at allocation.
 static inline void* allocate_pointerless(struct mutator *mut,
                                          enum alloc_kind kind,
                                          size_t size) {
-  return allocate(mut, kind, size);
+  return allocate_object(mut, kind, size, 1);
+}
+
+// Allocate up to N objects of the same KIND and SIZE, storing them in
+// OBJS, and return how many were allocated, which is at least 1.  All
+// objects that fit in the current hole are allocated at once, with a
+// single bounds check and bulk initialization of their metadata.  Only
+// the first allocation may cause a collection: if the current hole
+// can't fit even one object, we take the slow path for one object, then
+// continue carving from whatever hole it found.  Callers that need all
+// N objects should root the ones returned before asking for more.
+static inline size_t allocate_many(struct mutator *mut, enum alloc_kind kind,
+                                   size_t size, size_t n, void **objs) {
+  ASSERT(n > 0);
+  size_t granules = size_to_granules(size);
+  if (granules > LARGE_OBJECT_GRANULE_THRESHOLD) {
+    objs[0] = allocate_large(mut, kind, granules, 0);
+    return 1;
+  }
+
+  size_t bytes = granules * GRANULE_SIZE;
+  if (mut->sweep - mut->alloc < bytes)
+    acquire_hole(mut, granules);
+
+  size_t fit = (mut->sweep - mut->alloc) / bytes;
+  size_t batch = fit < n ? fit : n;
+  ASSERT(batch > 0);
+  uintptr_t alloc = mut->alloc;
+  mut->alloc = alloc + batch * bytes;
+  clear_for_allocation(&mut->clear, mut->alloc, mut->sweep, 0);
+
+  uintptr_t tag = tag_live(kind, 0);
+  for (size_t i = 0; i < batch; i++) {
+    struct gcobj *obj = (struct gcobj*)(alloc + i * bytes);
+    obj->tag = tag;
+    objs[i] = obj;
+  }
+
+  uint8_t *metadata = object_metadata_byte((void*)alloc);
+  if (granules == 1) {
+    memset(metadata, METADATA_BYTE_YOUNG | METADATA_BYTE_END, batch);
+  } else {
+    memset(metadata, 0, batch * granules);
+    for (size_t i = 0; i < batch; i++) {
+      metadata[i * granules] = METADATA_BYTE_YOUNG;
+      metadata[i * granules + granules - 1] = METADATA_BYTE_END;
+    }
+  }
+  return batch;
 }
 
 static inline void init_field(void **addr, void *val) {
@@ -1622,12 +3042,13 @@ static inline void* get_field(void **addr) {
   return *addr;
 }
 
-static struct slab* allocate_slabs(size_t nslabs) {
+// Reserve address space for NSLABS slabs, without committing memory.
+static struct slab* reserve_slabs(size_t nslabs) {
   size_t size = nslabs * SLAB_SIZE;
   size_t extent = size + SLAB_SIZE;
 
-  char *mem = mmap(NULL, extent, PROT_READ|PROT_WRITE,
-                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  char *mem = mmap(NULL, extent, PROT_NONE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
   if (mem == MAP_FAILED) {
     perror("mmap failed");
     return NULL;
@@ -1646,13 +3067,88 @@ static struct slab* allocate_slabs(size_t nslabs) {
   return (struct slab*) aligned_base;
 }
 
+static size_t parse_heap_size(const char *str, size_t default_size) {
+  char *end;
+  unsigned long long size = strtoull(str, &end, 10);
+  if (end == str)
+    return default_size;
+  switch (*end) {
+  case 'g': case 'G': size <<= 10; // fall through
+  case 'm': case 'M': size <<= 10; // fall through
+  case 'k': case 'K': size <<= 10; break;
+  default: break;
+  }
+  return size;
+}
+
+// With GC_CGROUP=1, or GC_CGROUP set to a cgroup directory, respect
+// the cgroup memory limit, taking the lower of memory.max and
+// memory.high; see cgroup.h.  The heap gets a fraction of the limit,
+// leaving the rest for the rest of the process.
+#define CGROUP_HEAP_FRACTION 0.75
+
+static size_t read_cgroup_limit(const char *dir, const char *name) {
+  char buf[64];
+  if (!cgroup_read_file(dir, name, buf, sizeof(buf)))
+    return SIZE_MAX;
+  // The file holds either a number of bytes or "max".
+  char *end;
+  unsigned long long bytes = strtoull(buf, &end, 10);
+  return end == buf ? SIZE_MAX : bytes;
+}
+
+static size_t cgroup_dir_memory_limit(const char *dir) {
+  size_t max = read_cgroup_limit(dir, "memory.max");
+  size_t high = read_cgroup_limit(dir, "memory.high");
+  return max < high ? max : high;
+}
+
+static size_t cgroup_memory_limit(void) {
+  if (!getenv("GC_CGROUP"))
+    return SIZE_MAX;
+  return cgroup_lowest_limit(cgroup_dir_memory_limit);
+}
+
+// Heap size to use if initialize_gc is passed a size of 0 and there is
+// no cgroup memory limit.
+#define DEFAULT_HEAP_SIZE (64 * 1024 * 1024)
+
 static int heap_init(struct heap *heap, size_t size) {
   // *heap is already initialized to 0.
 
   pthread_mutex_init(&heap->lock, NULL);
   pthread_cond_init(&heap->mutator_cond, NULL);
   pthread_cond_init(&heap->collector_cond, NULL);
+  // Under a cgroup memory limit, the heap starts off no larger than its
+  // share of the limit, by default at a quarter of it, and by default
+  // may grow up to the whole share.
+  size_t budget = cgroup_memory_limit();
+  if (budget != SIZE_MAX) {
+    budget *= CGROUP_HEAP_FRACTION;
+    if (!size)
+      size = budget / 4;
+    if (size > budget)
+      size = budget;
+  }
+  if (!size)
+    size = DEFAULT_HEAP_SIZE;
   heap->size = size;
+  // The heap may grow up to GC_MAXIMUM_HEAP_SIZE bytes.  By default it
+  // stays at its initial size.
+  heap->maximum_size = size;
+  if (getenv("GC_MAXIMUM_HEAP_SIZE"))
+    heap->maximum_size = parse_heap_size(getenv("GC_MAXIMUM_HEAP_SIZE"), size);
+  else if (budget != SIZE_MAX)
+    heap->maximum_size = budget;
+  if (heap->maximum_size < size)
+    heap->maximum_size = size;
+  heap->peak_size = size;
+  // With GC_ADAPTIVE_HEAP_SIZE=1, resize the heap once per cycle
+  // according to the live data size, allocation rate, and collection
+  // speed, between a minimum of a few megabytes and the maximum size;
+  // see resize_heap_adaptively.
+  if (getenv("GC_ADAPTIVE_HEAP_SIZE"))
+    heap->adaptive_sizing = atoi(getenv("GC_ADAPTIVE_HEAP_SIZE"));
 
   if (!tracer_init(heap))
     abort();
@@ -1666,9 +3162,40 @@ static int heap_init(struct heap *heap, size_t size) {
 static int mark_space_init(struct mark_space *space, struct heap *heap) {
   size_t size = align_up(heap->size, SLAB_SIZE);
   size_t nslabs = size / SLAB_SIZE;
-  struct slab *slabs = allocate_slabs(nslabs);
+  size_t reserved_nslabs = align_up(heap->maximum_size, SLAB_SIZE) / SLAB_SIZE;
+  struct slab *slabs = reserve_slabs(reserved_nslabs);
   if (!slabs)
     return 0;
+  if (mprotect(slabs, size, PROT_READ|PROT_WRITE)) {
+    perror("committing slabs failed");
+    return 0;
+  }
+
+  // With GC_HUGE_PAGES=1, ask for slabs to be backed by transparent
+  // huge pages, to reduce TLB misses when tracing and sweeping.
+  pthread_mutex_init(&space->decommit_lock, NULL);
+  space->decommit_advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+  // With GC_MADV_FREE=1, return memory lazily: the kernel only reclaims
+  // it under memory pressure, and reusing it is cheaper.
+  if (getenv("GC_MADV_FREE") && atoi(getenv("GC_MADV_FREE")))
+    space->decommit_advice = MADV_FREE;
+#endif
+  if (getenv("GC_HUGE_PAGES") && atoi(getenv("GC_HUGE_PAGES"))) {
+    if (madvise(slabs, reserved_nslabs * SLAB_SIZE, MADV_HUGEPAGE) == 0)
+      space->huge_pages = 1;
+    else
+      perror("madvise(MADV_HUGEPAGE) failed; continuing without huge pages");
+  }
+#ifdef GC_GEOMETRY_SLAB_2M
+  // Each 2 MB slab is a single huge page that also holds the slab's
+  // metadata, so any memory we return to the OS splits a huge page.
+  if (space->huge_pages)
+    fprintf(stderr, "warning: with 2 MB slabs, returning memory to the OS "
+            "splits huge pages\n");
+#endif
+
+  scan_bytes_init();
 
   uint8_t dead = METADATA_BYTE_MARK_0;
   uint8_t survived = METADATA_BYTE_MARK_1;
@@ -1678,21 +3205,24 @@ static int mark_space_init(struct mark_space *space, struct heap *heap) {
   rotate_mark_bytes(space);
   space->slabs = slabs;
   space->nslabs = nslabs;
+  space->reserved_nslabs = reserved_nslabs;
   space->low_addr = (uintptr_t) slabs;
   space->extent = size;
-  space->next_block = 0;
-  space->evacuation_reserve = 0.02;
+  space->numa_nodes = 1;
+  if (getenv("GC_NUMA") && atoi(getenv("GC_NUMA")))
+    space->numa_nodes = count_numa_nodes();
   for (size_t slab = 0; slab < nslabs; slab++) {
-    for (size_t block = 0; block < NONMETA_BLOCKS_PER_SLAB; block++) {
-      uintptr_t addr = (uintptr_t)slabs[slab].blocks[block].data;
-      if (size > heap->size) {
-        push_unavailable_block(space, addr);
-        size -= BLOCK_SIZE;
-      } else {
-        push_empty_block(space, addr);
-      }
+    if (!bind_slab_to_numa_node(space, slab)) {
+      perror("mbind failed; continuing without NUMA support");
+      space->numa_nodes = 1;
     }
   }
+  space->evacuation_reserve = 0.02;
+  // All blocks start off fresh; the ones beyond the heap size are
+  // unavailable.
+  size_t nblocks = nslabs * NONMETA_BLOCKS_PER_SLAB;
+  size_t unavailable = (size - heap->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  space->fresh_blocks = unavailable < nblocks ? nblocks - unavailable : 0;
   return 1;
 }
 
@@ -1714,6 +3244,9 @@ static int initialize_gc(size_t size, struct heap **heap,
   if (!large_object_space_init(heap_large_object_space(*heap), *heap))
     abort();
 
+  if (!sweepers_init(*heap))
+    abort();
+
   *mut = calloc(1, sizeof(struct mutator));
   if (!*mut) abort();
   add_mutator(*heap, *mut);
@@ -1730,6 +3263,8 @@ static struct mutator* initialize_gc_for_thread(uintptr_t *stack_base,
 }
 
 static void finish_gc_for_thread(struct mutator *mut) {
+  // Release the mutator's blocks, so that they can be swept and reused.
+  finish_sweeping_in_block(mut);
   remove_mutator(mutator_heap(mut), mut);
   mutator_mark_buf_destroy(&mut->mark_buf);
   free(mut);
@@ -1774,8 +3309,29 @@ static void* call_without_gc(struct mutator *mut,
 static inline void print_start_gc_stats(struct heap *heap) {
 }
 
+static void print_sweep_statistics(const char *threads,
+                                   struct sweep_statistics *stats) {
+  if (!stats->threads)
+    return;
+  printf("Sweep cursor claims by %s: %zu (%zu retries); per thread, "
+         "%.1f (%.1f retries) on average, at most %zu (%zu retries)\n",
+         threads, stats->claims, stats->retries,
+         (double) stats->claims / stats->threads,
+         (double) stats->retries / stats->threads,
+         stats->max_thread_claims, stats->max_thread_retries);
+}
+
 static inline void print_end_gc_stats(struct heap *heap) {
-  printf("Completed %ld collections\n", heap->count);
+  printf("Completed %ld collections (%zu emergency)\n", heap->count,
+         heap->emergency_collection_count);
   printf("Heap size with overhead is %zd (%zu slabs)\n",
          heap->size, heap_mark_space(heap)->nslabs);
+  printf("Geometry: %d-byte granules, %d kB blocks, %d MB slabs, "
+         "%d of %d blocks per slab for metadata\n",
+         GRANULE_SIZE, BLOCK_SIZE / 1024, SLAB_SIZE / (1024 * 1024),
+         META_BLOCKS_PER_SLAB, BLOCKS_PER_SLAB);
+  printf("Peak heap size is %zu (grew %zu times, shrank %zu times)\n",
+         heap->peak_size, heap->grow_count, heap->shrink_count);
+  print_sweep_statistics("mutators", &heap->mutator_sweep_statistics);
+  print_sweep_statistics("sweepers", &heap->sweeper_sweep_statistics);
 }